@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nbody.h"
+
+// A checkpoint is a header followed by the columns of body data, each starting on a page boundary:
+//   mass[nBodies]     float
+//   radius[nBodies]   float
+//   pva[nBodies]      nb_pva_t, as it is in memory
+// nb_loadWorld maps the file and points the world's current slot straight at the pva column, so restarting only reads
+// the pages the solver touches.  Files are only readable on machines with the same byte order and nb_pva_t.
+
+#define CHECKPOINT_MAGIC   "NBWORLD"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ORDER   0x01020304u
+#define CHECKPOINT_ALIGN   4096
+
+#define CHECKPOINT_ACCELERATIONS 1  // The pva column's accelerations match its positions.
+#define CHECKPOINT_JERKS         2  // And its jerks.
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t pvaSize;
+	uint32_t flags;
+	uint64_t nBodies;
+	uint64_t massOffset;
+	uint64_t radiusOffset;
+	uint64_t pvaOffset;
+	uint64_t fileSize;
+	float    t;
+	float    radius;
+	float    stiffness;
+	float    bounceFudgeFactor;
+	float    rkDt;               // So that NB_INTEGRATOR_DOPRI carries on with the same steps.
+} checkpointHeader_t;
+
+static uint64_t alignUp(uint64_t offset) {
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+static bool writeAt(FILE *f, uint64_t offset, const void *data, size_t size) {
+	return fseek(f, (long)offset, SEEK_SET) == 0 && fwrite(data, 1, size, f) == size;
+}
+
+// Write the world's current state.  Returns false, having said why, if the file couldn't be written.
+bool nb_saveWorld(nb_world_t *world, const char *path) {
+	uint64_t n = world->nBodies;
+	checkpointHeader_t h;
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, CHECKPOINT_MAGIC);
+	h.version      = CHECKPOINT_VERSION;
+	h.byteOrder    = CHECKPOINT_ORDER;
+	h.pvaSize      = sizeof(nb_pva_t);
+	h.flags        = (world->accelerationsValid ? CHECKPOINT_ACCELERATIONS : 0) | (world->jerksValid ? CHECKPOINT_JERKS : 0);
+	h.nBodies      = n;
+	h.massOffset   = alignUp(sizeof(h));
+	h.radiusOffset = alignUp(h.massOffset + n * sizeof(float));
+	h.pvaOffset    = alignUp(h.radiusOffset + n * sizeof(float));
+	h.fileSize     = h.pvaOffset + n * sizeof(nb_pva_t);
+	h.t                 = world->t;
+	h.radius            = world->radius;
+	h.stiffness         = world->stiffness;
+	h.bounceFudgeFactor = world->bounceFudgeFactor;
+	h.rkDt              = world->rkDt;
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("Couldn't create checkpoint %s\n", path);
+		return false;
+	}
+
+	float *column = (float *)malloc(n * sizeof(float));
+	for (uint64_t i = 0; i < n; i++)
+		column[i] = world->bodies[i].mass;
+	bool ok = writeAt(f, 0, &h, sizeof(h)) && writeAt(f, h.massOffset, column, n * sizeof(float));
+	for (uint64_t i = 0; i < n; i++)
+		column[i] = world->bodies[i].radius;
+	ok = ok && writeAt(f, h.radiusOffset, column, n * sizeof(float));
+	ok = ok && writeAt(f, h.pvaOffset, world->pva[world->current()], n * sizeof(nb_pva_t));
+	free(column);
+
+	if (fclose(f) != 0 || !ok) {
+		printf("Couldn't write checkpoint %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+// A world in the state nb_saveWorld found it, with every other setting at its default.  Returns NULL, having said why,
+// if the file can't be read or isn't a checkpoint this build understands.
+nb_world_t *nb_loadWorld(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Couldn't open checkpoint %s\n", path);
+		return NULL;
+	}
+
+	struct stat st;
+	checkpointHeader_t h;
+	if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, CHECKPOINT_MAGIC, 8) != 0) {
+		printf("%s isn't a checkpoint\n", path);
+		close(fd);
+		return NULL;
+	}
+	if (h.version != CHECKPOINT_VERSION || h.byteOrder != CHECKPOINT_ORDER || h.pvaSize != sizeof(nb_pva_t)) {
+		printf("Checkpoint %s is version %u, byte order %08x, with %u byte states, which this build can't read\n",
+		       path, h.version, h.byteOrder, h.pvaSize);
+		close(fd);
+		return NULL;
+	}
+	if (h.nBodies == 0 || h.nBodies > INT32_MAX || h.pvaOffset % NB_ALIGN != 0 ||
+	    h.massOffset + h.nBodies * sizeof(float) > h.fileSize ||
+	    h.radiusOffset + h.nBodies * sizeof(float) > h.fileSize ||
+	    h.pvaOffset + h.nBodies * sizeof(nb_pva_t) > h.fileSize || h.fileSize > (uint64_t)st.st_size) {
+		printf("Checkpoint %s is damaged or truncated\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	// Private, so the solver can write to the pva column without changing the file.
+	void *mapping = mmap(NULL, h.fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		printf("Couldn't map checkpoint %s\n", path);
+		return NULL;
+	}
+
+	int n = (int)h.nBodies;
+	nb_world_t *world = nb_createWorld(n);
+	world->t                 = h.t;
+	world->radius            = h.radius;
+	world->stiffness         = h.stiffness;
+	world->bounceFudgeFactor = h.bounceFudgeFactor;
+	world->rkDt              = h.rkDt;
+	// The saved accelerations and jerks came from whatever force mode, softening and opening angle the saving world used,
+	// which needn't be this one's.  The flags only say what the file holds; the first step recalculates them.
+	world->accelerationsValid = false;
+	world->jerksValid         = false;
+
+	const float *mass   = (const float *)((char *)mapping + h.massOffset);
+	const float *radius = (const float *)((char *)mapping + h.radiusOffset);
+	for (int i = 0; i < n; i++) {
+		world->bodies[i].mass   = mass[i];
+		world->bodies[i].radius = radius[i];
+	}
+
+	free(world->pva[world->current()]);
+	world->pva[world->current()] = (nb_pva_t *)((char *)mapping + h.pvaOffset);
+	world->mapping     = mapping;
+	world->mappingSize = h.fileSize;
+	return world;
+}
@@ -1,4 +1,5 @@
 
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -6,12 +7,24 @@
 
 const float DEFAULT_STIFFNESS = 0.1f;
 
-// Make sure objects don't walk off the screen by transforming the model to center-of-mass coordinates
+// Make sure objects don't walk off the screen by transforming the model to center-of-mass coordinates.
+// Only the mass weighted sums are needed, so this doesn't call nb_getSummaryValues, which is O(N^2).
 void centerModel(nb_world_t *world) {
 	M3DVector3f vtot, com;
-	float mtot, etot;
-	
-	nb_getSummaryValues(mtot, com, vtot, etot, world);
+	float mtot = 0.0f;
+
+	m3dLoadVector3(com,  0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(vtot, 0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < world->nBodies; i++) {
+		float m = world->bodies[i].mass;
+		float *p = world->getCurrentPVA(i)->position;
+		float *v = world->getCurrentPVA(i)->velocity;
+		mtot += m;
+		com[0]  += p[0] * m;  com[1]  += p[1] * m;  com[2]  += p[2] * m;
+		vtot[0] += v[0] * m;  vtot[1] += v[1] * m;  vtot[2] += v[2] * m;
+	}
+	m3dScaleVector3(com, 1.0f/mtot);
+	m3dScaleVector3(vtot, 1.0f/mtot);
 
 	for (int i = 0; i < world->nBodies; i++) {
 		m3dSubtractVectors3(world->getCurrentPVA(i)->velocity, world->getCurrentPVA(i)->velocity, vtot);
@@ -19,7 +32,7 @@ void centerModel(nb_world_t *world) {
 	}
 }
 
-nb_world_t *nb_createOrbit2World() {
+nb_world_t *nb_createOrbit2World(int, unsigned) {
 	nb_world_t *world = nb_createWorld(2);
 	world->radius = 20.0f;
 	world->stiffness = DEFAULT_STIFFNESS;
@@ -27,19 +40,19 @@ nb_world_t *nb_createOrbit2World() {
 
 	world->bodies[0].mass   = 10.0f;
 	world->bodies[0].radius = 2.5f;
-	m3dLoadVector3(world->bodies[0].pva[world->current()].position, 0.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[0].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[1].mass   = 1.0f;
 	world->bodies[1].radius = 0.5f;
-	m3dLoadVector3(world->bodies[1].pva[world->current()].position, -10.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[1].pva[world->current()].velocity, 0.0f, 0.7f, 0.7f);
+	m3dLoadVector3(world->getCurrentPVA(1)->position, -10.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->velocity, 0.0f, 0.7f, 0.7f);
 	
 	centerModel(world);
 	return world;
 }
 
-nb_world_t *nb_createOrbit3World() {
+nb_world_t *nb_createOrbit3World(int, unsigned) {
 	nb_world_t *world = nb_createWorld(3);
 	world->radius = 20.0f;
 	world->stiffness = DEFAULT_STIFFNESS;
@@ -47,24 +60,24 @@ nb_world_t *nb_createOrbit3World() {
 
 	world->bodies[0].mass   = 1.0f;
 	world->bodies[0].radius = 1.5f;
-	m3dLoadVector3(world->bodies[0].pva[world->current()].position, 0.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[0].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[1].mass   = 0.1f;
 	world->bodies[1].radius = 0.3f;
-	m3dLoadVector3(world->bodies[1].pva[world->current()].position, -10.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[1].pva[world->current()].velocity, 0.0f, 0.2f, 0.25f);
+	m3dLoadVector3(world->getCurrentPVA(1)->position, -10.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->velocity, 0.0f, 0.2f, 0.25f);
 
 	world->bodies[2].mass   = 0.02f;
 	world->bodies[2].radius = 0.05f;
-	m3dLoadVector3(world->bodies[2].pva[world->current()].position, -11.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[2].pva[world->current()].velocity, 0.0f, 0.45f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(2)->position, -11.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(2)->velocity, 0.0f, 0.45f, 0.0f);
 	
 	centerModel(world);
 	return world;
 }
 
-nb_world_t *nb_createBounce2World() {
+nb_world_t *nb_createBounce2World(int, unsigned) {
 	nb_world_t *world = nb_createWorld(2);
 	world->radius = 20.0f;
 	world->stiffness = DEFAULT_STIFFNESS * 5;
@@ -72,19 +85,19 @@ nb_world_t *nb_createBounce2World() {
 
 	world->bodies[0].mass   = 1.0f;
 	world->bodies[0].radius = 1.0f;
-	m3dLoadVector3(world->bodies[0].pva[world->current()].position, 0.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[0].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[1].mass   = 2.0f;
 	world->bodies[1].radius = 2.0f;
-	m3dLoadVector3(world->bodies[1].pva[world->current()].position, -10.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[1].pva[world->current()].velocity, 0.0f, 0.3f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->position, -10.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->velocity, 0.0f, 0.3f, 0.0f);
 	
 	centerModel(world);
 	return world;
 }
 
-nb_world_t *nb_createBounce2bWorld() {
+nb_world_t *nb_createBounce2bWorld(int, unsigned) {
 	nb_world_t *world = nb_createWorld(2);
 	world->radius = 15.0f;
 	world->stiffness = DEFAULT_STIFFNESS * 5;
@@ -92,19 +105,19 @@ nb_world_t *nb_createBounce2bWorld() {
 
 	world->bodies[0].mass   = 1.0f;
 	world->bodies[0].radius = 1.0f;
-	m3dLoadVector3(world->bodies[0].pva[world->current()].position, 0.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[0].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[1].mass   = 2.0f;
 	world->bodies[1].radius = 2.0f;
-	m3dLoadVector3(world->bodies[1].pva[world->current()].position, -10.0f, 0.0f, 0.0f);
-	m3dLoadVector3(world->bodies[1].pva[world->current()].velocity, 1.0f, 0.3f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->position, -10.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->velocity, 1.0f, 0.3f, 0.0f);
 	
 	centerModel(world);
 	return world;
 }
 
-nb_world_t *nb_createBounce4World() {
+nb_world_t *nb_createBounce4World(int, unsigned) {
 	nb_world_t *world = nb_createWorld(4);
 	world->radius = 20.0f;
 	world->stiffness = DEFAULT_STIFFNESS * 5;
@@ -112,29 +125,29 @@ nb_world_t *nb_createBounce4World() {
 
 	world->bodies[0].mass   = 1.0f;
 	world->bodies[0].radius = 1.0f;
-	m3dLoadVector3(world->bodies[0].pva[world->current()].position, 10.0f, 10.0f, 0.0f);
-	m3dLoadVector3(world->bodies[0].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 10.0f, 10.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[1].mass   = 1.0f;
 	world->bodies[1].radius = 1.0f;
-	m3dLoadVector3(world->bodies[1].pva[world->current()].position, 10.0f, -10.0f, 0.0f);
-	m3dLoadVector3(world->bodies[1].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->position, 10.0f, -10.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(1)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[2].mass   = 1.0f;
 	world->bodies[2].radius = 1.0f;
-	m3dLoadVector3(world->bodies[2].pva[world->current()].position, -10.0f, -10.0f, 0.0f);
-	m3dLoadVector3(world->bodies[2].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(2)->position, -10.0f, -10.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(2)->velocity, 0.0f, 0.0f, 0.0f);
 
 	world->bodies[3].mass   = 1.0f;
 	world->bodies[3].radius = 1.0f;
-	m3dLoadVector3(world->bodies[3].pva[world->current()].position, -10.0f, 10.0f, 0.0f);
-	m3dLoadVector3(world->bodies[3].pva[world->current()].velocity, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(3)->position, -10.0f, 10.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(3)->velocity, 0.0f, 0.0f, 0.0f);
 	
 	centerModel(world);
 	return world;
 }
 
-nb_world_t *nb_createBounce9World() {
+nb_world_t *nb_createBounce9World(int, unsigned) {
 	nb_world_t *world = nb_createWorld(9);
 	world->radius = 15.0f;
 	world->stiffness = DEFAULT_STIFFNESS * 5;
@@ -145,21 +158,196 @@ nb_world_t *nb_createBounce9World() {
 		int y = i/3 - 1;
 		world->bodies[i].mass   = 1.0f;
 		world->bodies[i].radius = 1.0f;
-		m3dLoadVector3(world->bodies[i].pva[world->current()].position, 5.0f*x, 5.0f*y, 0.0f);
-		m3dLoadVector3(world->bodies[i].pva[world->current()].velocity, 0.0f, 1.0f*x, 1.0f*y);
+		m3dLoadVector3(world->getCurrentPVA(i)->position, 5.0f*x, 5.0f*y, 0.0f);
+		m3dLoadVector3(world->getCurrentPVA(i)->velocity, 0.0f, 1.0f*x, 1.0f*y);
 	}
 	
 	centerModel(world);
 	return world;
 }
 
+// Generated worlds each draw from their own generator, so a world depends only on its seed.
+// SplitMix64 is small, fast, and gives a good sequence from any seed, including nearby ones.
+typedef struct {
+	unsigned long long state;
+} rng_t;
+
+static unsigned long long rngNext(rng_t *rng) {
+	unsigned long long z = (rng->state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1), so it is safe to take logs of.
+static double rngUniform(rng_t *rng) {
+	return ((rngNext(rng) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+static void randomDirection(rng_t *rng, M3DVector3f v, float length) {
+	double z   = 2.0 * rngUniform(rng) - 1.0;
+	double phi = 2.0 * M_PI * rngUniform(rng);
+	double s   = sqrt(1.0 - z*z);
+	m3dLoadVector3(v, (float)(length * s * cos(phi)), (float)(length * s * sin(phi)), (float)(length * z));
+}
+
+// Bodies are given a radius of a fraction of their typical spacing, so collisions stay rare.
+static void setEqualBodies(nb_world_t *world, int first, int n, float mass, float scale) {
+	float radius = 0.25f * scale / cbrtf((float)n);
+	for (int i = first; i < first + n; i++) {
+		world->bodies[i].mass   = mass / n;
+		world->bodies[i].radius = radius;
+	}
+}
+
+static nb_world_t *createGeneratedWorld(int nBodies, float radius) {
+	nb_world_t *world = nb_createWorld(nBodies);
+	world->radius = radius;
+	world->stiffness = DEFAULT_STIFFNESS;
+	world->bounceFudgeFactor = 1.5f;
+	return world;
+}
+
+// Plummer sphere in equilibrium, by the method of Aarseth, Henon and Wielen (1974).  Bodies beyond rMax are drawn again.
+static void plummerBodies(nb_world_t *world, rng_t *rng, int first, int n, float mass, float a, float rMax) {
+	setEqualBodies(world, first, n, mass, a);
+	for (int i = first; i < first + n; i++) {
+		nb_pva_t *pva = world->getCurrentPVA(i);
+		double r;
+		do {
+			r = a / sqrt(pow(rngUniform(rng), -2.0 / 3.0) - 1.0);
+		} while (r > rMax);
+		randomDirection(rng, pva->position, (float)r);
+
+		// Speed as a fraction q of the escape speed, with probability proportional to q^2 (1 - q^2)^3.5.
+		double q, g;
+		do {
+			q = rngUniform(rng);
+			g = 0.1 * rngUniform(rng);
+		} while (g > q*q * pow(1.0 - q*q, 3.5));
+		double vEscape = sqrt(2.0 * BIGG * mass / a) * pow(1.0 + r*r / (a*a), -0.25);
+		randomDirection(rng, pva->velocity, (float)(q * vEscape));
+	}
+}
+
+const float PLUMMER_MASS   = 5.0f;
+const float PLUMMER_RADIUS = 3.0f;
+
+nb_world_t *nb_createPlummerWorld(int nBodies, unsigned seed) {
+	nb_world_t *world = createGeneratedWorld(nBodies, 10.0f * PLUMMER_RADIUS);
+	rng_t rng = { seed };
+	plummerBodies(world, &rng, 0, nBodies, PLUMMER_MASS, PLUMMER_RADIUS, 8.0f * PLUMMER_RADIUS);
+	centerModel(world);
+	return world;
+}
+
+// Exponential disk around a central mass, on circular orbits with a little random motion.  Each orbit's speed allows for
+// the central mass and the disk inside it as if the disk were spherical, which is close enough to hold together.
+const float DISK_CENTRAL_MASS = 5.0f;
+const float DISK_MASS         = 5.0f;
+const float DISK_SCALE        = 4.0f;
+const float DISK_THICKNESS    = 0.1f;   // Of the scale length.
+const float DISK_DISPERSION   = 0.05f;  // Of the circular speed.
+
+nb_world_t *nb_createDiskWorld(int nBodies, unsigned seed) {
+	nb_world_t *world = createGeneratedWorld(nBodies, 6.0f * DISK_SCALE);
+	rng_t rng = { seed };
+
+	world->bodies[0].mass   = DISK_CENTRAL_MASS;
+	world->bodies[0].radius = 0.25f * DISK_SCALE;
+	m3dLoadVector3(world->getCurrentPVA(0)->position, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(world->getCurrentPVA(0)->velocity, 0.0f, 0.0f, 0.0f);
+
+	int n = nBodies - 1;
+	setEqualBodies(world, 1, n, DISK_MASS, DISK_SCALE);
+	for (int i = 1; i < nBodies; i++) {
+		nb_pva_t *pva = world->getCurrentPVA(i);
+
+		// The surface density exp(-R / Rd) puts R * exp(-R / Rd) of the mass at radius R, which is the sum of two
+		// exponential variables.  Orbits inside the central body are drawn again.
+		double R;
+		do {
+			R = -DISK_SCALE * log(rngUniform(&rng) * rngUniform(&rng));
+		} while (R > 5.0 * DISK_SCALE || R < 2.0 * world->bodies[0].radius);
+		double phi = 2.0 * M_PI * rngUniform(&rng);
+		double u   = rngUniform(&rng);
+		double z   = 0.5 * DISK_THICKNESS * DISK_SCALE * log(u / (1.0 - u));
+
+		double x = R / DISK_SCALE;
+		double inside = DISK_CENTRAL_MASS + DISK_MASS * (1.0 - (1.0 + x) * exp(-x));
+		double v = sqrt(BIGG * inside / R);
+
+		M3DVector3f dv;
+		randomDirection(&rng, dv, (float)(DISK_DISPERSION * v * rngUniform(&rng)));
+		m3dLoadVector3(pva->position, (float)(R * cos(phi)), (float)(R * sin(phi)), (float)z);
+		m3dLoadVector3(pva->velocity, (float)(-v * sin(phi)), (float)(v * cos(phi)), 0.0f);
+		m3dAddVectors3(pva->velocity, pva->velocity, dv);
+	}
+
+	centerModel(world);
+	return world;
+}
+
+// Uniform sphere of bodies at rest, which collapses in about sqrt(3 pi / (32 G rho)).
+const float COLLAPSE_MASS   = 5.0f;
+const float COLLAPSE_RADIUS = 10.0f;
+
+nb_world_t *nb_createCollapseWorld(int nBodies, unsigned seed) {
+	nb_world_t *world = createGeneratedWorld(nBodies, 2.0f * COLLAPSE_RADIUS);
+	rng_t rng = { seed };
+
+	setEqualBodies(world, 0, nBodies, COLLAPSE_MASS, COLLAPSE_RADIUS);
+	for (int i = 0; i < nBodies; i++) {
+		nb_pva_t *pva = world->getCurrentPVA(i);
+		randomDirection(&rng, pva->position, (float)(COLLAPSE_RADIUS * cbrt(rngUniform(&rng))));
+		m3dLoadVector3(pva->velocity, 0.0f, 0.0f, 0.0f);
+	}
+
+	centerModel(world);
+	return world;
+}
+
+// Two Plummer spheres on a bound, slightly off center, collision course.
+const float CLUSTERS_SEPARATION = 12.0f;
+const float CLUSTERS_OFFSET     = 2.0f;
+const float CLUSTERS_RADIUS     = 2.0f;
+const float CLUSTERS_SPEED      = 0.8f;  // Of the speed at which they would just escape each other.
+
+nb_world_t *nb_createClustersWorld(int nBodies, unsigned seed) {
+	nb_world_t *world = createGeneratedWorld(nBodies, 2.5f * CLUSTERS_SEPARATION);
+	rng_t rng = { seed };
+
+	int n[2] = { nBodies / 2, nBodies - nBodies / 2 };
+	float mass = PLUMMER_MASS / 2;
+	float v = CLUSTERS_SPEED * 0.5f * sqrtf(2.0f * BIGG * PLUMMER_MASS / CLUSTERS_SEPARATION);
+	for (int c = 0, first = 0; c < 2; first += n[c], c++) {
+		float side = (c == 0) ? -1.0f : 1.0f;
+		M3DVector3f dp, dv;
+		m3dLoadVector3(dp, side * 0.5f * CLUSTERS_SEPARATION, side * 0.5f * CLUSTERS_OFFSET, 0.0f);
+		m3dLoadVector3(dv, -side * v, 0.0f, 0.0f);
+
+		plummerBodies(world, &rng, first, n[c], mass, CLUSTERS_RADIUS, 4.0f * CLUSTERS_RADIUS);
+		for (int i = first; i < first + n[c]; i++) {
+			m3dAddVectors3(world->getCurrentPVA(i)->position, world->getCurrentPVA(i)->position, dp);
+			m3dAddVectors3(world->getCurrentPVA(i)->velocity, world->getCurrentPVA(i)->velocity, dv);
+		}
+	}
+
+	centerModel(world);
+	return world;
+}
+
 nb_creator_t creators[] = {
-	{"orbit2",    nb_createOrbit2World},
-	{"orbit3",    nb_createOrbit3World},
-	{"bounce2",   nb_createBounce2World},
-	{"bounce2b",  nb_createBounce2bWorld},
-	{"bounce4",   nb_createBounce4World},
-	{"bounce9",   nb_createBounce9World}
+	{"orbit2",    nb_createOrbit2World,   0},
+	{"orbit3",    nb_createOrbit3World,   0},
+	{"bounce2",   nb_createBounce2World,  0},
+	{"bounce2b",  nb_createBounce2bWorld, 0},
+	{"bounce4",   nb_createBounce4World,  0},
+	{"bounce9",   nb_createBounce9World,  0},
+	{"plummer",   nb_createPlummerWorld,  1000},
+	{"disk",      nb_createDiskWorld,     1000},
+	{"collapse",  nb_createCollapseWorld, 1000},
+	{"clusters",  nb_createClustersWorld, 1000}
 };
 
 int nCreators = sizeof(creators)/sizeof(nb_creator_t);
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nbody.h"
+
+// Cell coordinates are clamped to this, so bodies far outside the world share the outermost cells instead of overflowing.
+#define MAX_CELL 1000000000.0f
+
+static inline int cellCoord(float x, float cellSize) {
+	float c = floorf(x / cellSize);
+	if (c >  MAX_CELL) c =  MAX_CELL;
+	if (c < -MAX_CELL) c = -MAX_CELL;
+	return (int)c;
+}
+
+static inline int hashCell(nb_grid_t *grid, int x, int y, int z) {
+	unsigned h = ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+	return (int)(h & (unsigned)(grid->nBuckets - 1));
+}
+
+// Hash every body into cells of the given size.  Body i is at positions[i * stride].
+// The bodies are counting sorted by bucket.
+void nb_buildGrid(nb_world_t *world, const float *positions, int stride, float cellSize) {
+	if (world->grid == NULL)
+		world->grid = (nb_grid_t *)calloc(1, sizeof(nb_grid_t));
+	nb_grid_t *grid = world->grid;
+
+	if (grid->nBodies < world->nBodies) {
+		int nBuckets = 1;
+		while (nBuckets < 2 * world->nBodies)
+			nBuckets *= 2;
+		grid->nBodies  = world->nBodies;
+		grid->nBuckets = nBuckets;
+		grid->bucketStart = (int *)realloc(grid->bucketStart, (nBuckets + 1) * sizeof(int));
+		grid->bodies      = (int *)realloc(grid->bodies, world->nBodies * sizeof(int));
+		grid->bodyCell    = (int *)realloc(grid->bodyCell, 3 * world->nBodies * sizeof(int));
+	}
+	grid->cellSize = cellSize;
+
+	for (int b = 0; b <= grid->nBuckets; b++)
+		grid->bucketStart[b] = 0;
+
+	for (int i = 0; i < world->nBodies; i++) {
+		const float *pos = &positions[i * stride];
+		int *cell = &grid->bodyCell[3 * i];
+		cell[0] = cellCoord(pos[0], cellSize);
+		cell[1] = cellCoord(pos[1], cellSize);
+		cell[2] = cellCoord(pos[2], cellSize);
+		grid->bucketStart[hashCell(grid, cell[0], cell[1], cell[2]) + 1]++;
+	}
+	for (int b = 0; b < grid->nBuckets; b++)
+		grid->bucketStart[b + 1] += grid->bucketStart[b];
+
+	// Fill each bucket from its end, so that bodies stay in index order within it.  That leaves bucketStart[b + 1]
+	// at the start of bucket b, so shift it back down.
+	for (int i = world->nBodies - 1; i >= 0; i--) {
+		int *cell = &grid->bodyCell[3 * i];
+		int b = hashCell(grid, cell[0], cell[1], cell[2]);
+		grid->bodies[--grid->bucketStart[b + 1]] = i;
+	}
+	for (int b = 0; b < grid->nBuckets; b++)
+		grid->bucketStart[b] = grid->bucketStart[b + 1];
+	grid->bucketStart[grid->nBuckets] = world->nBodies;
+}
+
+// Distinct buckets holding the 27 cells around a body's own.  Returns how many there are, at most 27.
+// Listing each bucket once means each nearby body is visited once, even when neighbouring cells share a bucket.
+int nb_gridNeighbours(nb_grid_t *grid, int body, int *buckets) {
+	int *cell = &grid->bodyCell[3 * body];
+	int n = 0;
+	for (int dz = -1; dz <= 1; dz++) {
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				int b = hashCell(grid, cell[0] + dx, cell[1] + dy, cell[2] + dz);
+				int k = 0;
+				while (k < n && buckets[k] != b)
+					k++;
+				if (k == n)
+					buckets[n++] = b;
+			}
+		}
+	}
+	return n;
+}
+
+void nb_freeGrid(nb_grid_t *grid) {
+	if (grid == NULL)
+		return;
+	free(grid->bucketStart);
+	free(grid->bodies);
+	free(grid->bodyCell);
+	free(grid);
+}
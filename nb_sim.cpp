@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "nbody.h"
+
+// Runs nb_integrate on its own thread and hands copies of the state to one reader through a triple buffer.
+// The writer fills its back buffer and swaps it with the middle one, the reader swaps its front buffer with the middle one
+// if it has been refreshed.  Both swaps are a single atomic exchange, so neither side ever waits for the other.
+#define SNAP_FRESH 4  // Set in `middle` when it holds a snapshot the reader hasn't taken yet.
+
+// The totals sum over every pair of bodies, so they are only found every SUMMARY_EVERY steps, and in the first.
+#define SUMMARY_EVERY 1000
+
+struct nb_sim {
+	nb_world_t *world;
+	float dt;
+	float timeScale;
+	bool  deform;
+
+	nb_snapshot_t snapshots[3];
+	int back;      // Writer's.
+	int middle;    // Shared.  Index, plus SNAP_FRESH.
+	int front;     // Reader's.
+
+	// The latest totals, copied into every snapshot until they are found again.
+	long        summaryFrame;
+	float       totalMass;
+	M3DVector3f centerOfMass;
+	M3DVector3f totalVelocity;
+	float       totalEnergy;
+
+	float pixelsPerUnit;  // Shared.  Set by nb_setSimPixelsPerUnit, copied into the world between steps.
+
+	pthread_t thread;
+	bool quit;
+};
+
+static double wallTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void copyBody(nb_bodySnapshot_t *bs, nb_body_t *b, nb_pva_t *pva, bool deform) {
+	m3dCopyVector3(bs->position, pva->position);
+	bs->radius = b->radius;
+	if (!deform)
+		return;
+
+	// Keep the model alive for as long as the snapshot refers to it, as the world may move the body to another.
+	if (bs->model != b->unitSphere) {
+		if (bs->model != NULL)
+			sm_releaseModel(bs->model);
+		bs->model = sm_acquireUnitSphere(b->unitSphere->precision);
+	}
+
+	int n = b->unitSphere->nVertices;
+	if (bs->maxVertices < n) {
+		bs->maxVertices = n;
+		bs->vertices = (M3DVector3f *)realloc(bs->vertices, n * sizeof(M3DVector3f));
+		bs->normals  = (M3DVector3f *)realloc(bs->normals,  n * sizeof(M3DVector3f));
+		bs->colors   = (M3DVector3f *)realloc(bs->colors,   n * sizeof(M3DVector3f));
+	}
+	memcpy(bs->vertices, b->displayVertices, n * sizeof(M3DVector3f));
+	memcpy(bs->normals,  b->displayNormals,  n * sizeof(M3DVector3f));
+	memcpy(bs->colors,   b->displayColors,   n * sizeof(M3DVector3f));
+}
+
+static void publish(nb_sim_t *sim, long frame) {
+	nb_world_t *world = sim->world;
+	nb_snapshot_t *snap = &sim->snapshots[sim->back];
+	snap->t     = world->t;
+	snap->frame = frame;
+	if (frame == 1 || frame % SUMMARY_EVERY == 0) {
+		nb_getSummaryValues(sim->totalMass, sim->centerOfMass, sim->totalVelocity, sim->totalEnergy, world);
+		sim->summaryFrame = frame;
+	}
+	snap->summaryFrame = sim->summaryFrame;
+	snap->totalMass    = sim->totalMass;
+	m3dCopyVector3(snap->centerOfMass, sim->centerOfMass);
+	m3dCopyVector3(snap->totalVelocity, sim->totalVelocity);
+	snap->totalEnergy  = sim->totalEnergy;
+	for (int i = 0; i < world->nBodies; i++)
+		copyBody(&snap->bodies[i], &world->bodies[i], world->getCurrentPVA(i), sim->deform);
+
+	sim->back = __atomic_exchange_n(&sim->middle, sim->back | SNAP_FRESH, __ATOMIC_ACQ_REL) & ~SNAP_FRESH;
+}
+
+static void *simThread(void *arg) {
+	nb_sim_t *sim = (nb_sim_t *)arg;
+	nb_world_t *world = sim->world;
+	double start = wallTime();
+	float  t0    = world->t;
+
+	for (long frame = 1; !__atomic_load_n(&sim->quit, __ATOMIC_ACQUIRE); frame++) {
+		__atomic_load(&sim->pixelsPerUnit, &world->pixelsPerUnit, __ATOMIC_RELAXED);
+		nb_integrate(world, sim->dt);
+		if (sim->deform)
+			nb_deformWorld(world);
+		publish(sim, frame);
+
+		// Don't get ahead of the wall clock.
+		if (sim->timeScale > 0.0f) {
+			double ahead = (world->t - t0) / sim->timeScale - (wallTime() - start);
+			if (ahead > 0.0) {
+				struct timespec ts;
+				ts.tv_sec  = (time_t)ahead;
+				ts.tv_nsec = (long)((ahead - ts.tv_sec) * 1e9);
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Start advancing the world by dt at a time on a new thread.  The world belongs to that thread until nb_stopSim.
+// If timeScale is positive, the simulation runs at most timeScale units of simulated time per second.
+// If deform is set, each step also runs nb_deformWorld, and the snapshots include the bodies' display buffers.
+nb_sim_t *nb_startSim(nb_world_t *world, float dt, float timeScale, bool deform) {
+	nb_sim_t *sim = (nb_sim_t *)calloc(1, sizeof(nb_sim_t));
+	sim->world     = world;
+	sim->dt        = dt;
+	sim->timeScale = timeScale;
+	sim->deform    = deform;
+	sim->pixelsPerUnit = world->pixelsPerUnit;
+	for (int k = 0; k < 3; k++) {
+		sim->snapshots[k].nBodies = world->nBodies;
+		sim->snapshots[k].bodies  = (nb_bodySnapshot_t *)calloc(world->nBodies, sizeof(nb_bodySnapshot_t));
+	}
+	sim->back   = 0;
+	sim->middle = 1;
+	sim->front  = 2;
+
+	if (pthread_create(&sim->thread, NULL, simThread, sim) != 0) {
+		printf("Couldn't create simulation thread\n");
+		exit(-1);
+	}
+	return sim;
+}
+
+// Pass a new screen scale to the simulation thread, for picking detail levels.  It takes effect from the next step.
+void nb_setSimPixelsPerUnit(nb_sim_t *sim, float pixelsPerUnit) {
+	__atomic_store(&sim->pixelsPerUnit, &pixelsPerUnit, __ATOMIC_RELAXED);
+}
+
+// The most recent snapshot, or NULL if there hasn't been one yet.  Never blocks.  Only one thread may read snapshots,
+// and a snapshot stays valid until that thread's next call.
+nb_snapshot_t *nb_latestSnapshot(nb_sim_t *sim) {
+	if (__atomic_load_n(&sim->middle, __ATOMIC_ACQUIRE) & SNAP_FRESH)
+		sim->front = __atomic_exchange_n(&sim->middle, sim->front, __ATOMIC_ACQ_REL) & ~SNAP_FRESH;
+
+	nb_snapshot_t *snap = &sim->snapshots[sim->front];
+	return (snap->frame > 0) ? snap : NULL;
+}
+
+// Stop the simulation thread and free the snapshots.  The world is the caller's again.
+void nb_stopSim(nb_sim_t *sim) {
+	__atomic_store_n(&sim->quit, true, __ATOMIC_RELEASE);
+	pthread_join(sim->thread, NULL);
+
+	for (int k = 0; k < 3; k++) {
+		for (int i = 0; i < sim->snapshots[k].nBodies; i++) {
+			nb_bodySnapshot_t *bs = &sim->snapshots[k].bodies[i];
+			if (bs->model != NULL)
+				sm_releaseModel(bs->model);
+			free(bs->vertices);
+			free(bs->normals);
+			free(bs->colors);
+		}
+		free(sim->snapshots[k].bodies);
+	}
+	free(sim);
+}
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <immintrin.h>
+
+#include "nbody.h"
+
+// Direct-sum force kernels over the structure-of-arrays copy of a slot.
+// Each processes a whole vector of source bodies per iteration, using the packed arrays' padding instead of a scalar tail.
+// 1/r comes from the hardware reciprocal square root estimate refined with one Newton-Raphson step: y' = y * (1.5 - 0.5 * r2 * y * y).
+// Lanes for excludeBody and for the padding are masked out after the scale is calculated, which also discards the infinities from r2 == 0.
+// The potential, if wanted, is G m times the same 1/r, masked the same way.
+
+__attribute__((target("avx2,fma")))
+static void avx2ForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_soa_t *soa, int nBodies, int excludeBody) {
+	const __m256 px = _mm256_set1_ps(pos[0]);
+	const __m256 py = _mm256_set1_ps(pos[1]);
+	const __m256 pz = _mm256_set1_ps(pos[2]);
+	const __m256 half      = _mm256_set1_ps(0.5f);
+	const __m256 threeHalf = _mm256_set1_ps(1.5f);
+	const __m256 bigG      = _mm256_set1_ps(BIGG);
+	const __m256i n        = _mm256_set1_epi32(nBodies);
+	const __m256i exclude  = _mm256_set1_epi32(excludeBody);
+	const __m256i step     = _mm256_set1_epi32(8);
+	__m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	__m256 fx = _mm256_setzero_ps();
+	__m256 fy = _mm256_setzero_ps();
+	__m256 fz = _mm256_setzero_ps();
+	__m256 pot = _mm256_setzero_ps();
+
+	for (int j = 0; j < nBodies; j += 8) {
+		__m256 dx = _mm256_sub_ps(_mm256_load_ps(soa->x + j), px);
+		__m256 dy = _mm256_sub_ps(_mm256_load_ps(soa->y + j), py);
+		__m256 dz = _mm256_sub_ps(_mm256_load_ps(soa->z + j), pz);
+		__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+		__m256 y = _mm256_rsqrt_ps(r2);
+		y = _mm256_mul_ps(y, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(y, y), threeHalf));
+		__m256 gm    = _mm256_mul_ps(bigG, _mm256_load_ps(soa->mass + j));
+		__m256 scale = _mm256_mul_ps(gm, _mm256_mul_ps(y, _mm256_mul_ps(y, y)));
+
+		__m256i keep = _mm256_andnot_si256(_mm256_cmpeq_epi32(idx, exclude), _mm256_cmpgt_epi32(n, idx));
+		scale = _mm256_and_ps(scale, _mm256_castsi256_ps(keep));
+
+		fx = _mm256_fmadd_ps(dx, scale, fx);
+		fy = _mm256_fmadd_ps(dy, scale, fy);
+		fz = _mm256_fmadd_ps(dz, scale, fz);
+		if (phi != NULL)
+			pot = _mm256_add_ps(pot, _mm256_and_ps(_mm256_mul_ps(gm, y), _mm256_castsi256_ps(keep)));
+		idx = _mm256_add_epi32(idx, step);
+	}
+
+	float lanes[4][8] __attribute__((aligned(32)));
+	_mm256_store_ps(lanes[0], fx);
+	_mm256_store_ps(lanes[1], fy);
+	_mm256_store_ps(lanes[2], fz);
+	_mm256_store_ps(lanes[3], pot);
+	m3dLoadVector3(ff, 0.0f, 0.0f, 0.0f);
+	float p = 0.0f;
+	for (int k = 0; k < 8; k++) {
+		ff[0] += lanes[0][k];
+		ff[1] += lanes[1][k];
+		ff[2] += lanes[2][k];
+		p     -= lanes[3][k];
+	}
+	if (phi != NULL)
+		*phi = p;
+}
+
+__attribute__((target("avx512f")))
+static void avx512ForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_soa_t *soa, int nBodies, int excludeBody) {
+	const __m512 px = _mm512_set1_ps(pos[0]);
+	const __m512 py = _mm512_set1_ps(pos[1]);
+	const __m512 pz = _mm512_set1_ps(pos[2]);
+	const __m512 half      = _mm512_set1_ps(0.5f);
+	const __m512 threeHalf = _mm512_set1_ps(1.5f);
+	const __m512 bigG      = _mm512_set1_ps(BIGG);
+	const __m512i n        = _mm512_set1_epi32(nBodies);
+	const __m512i exclude  = _mm512_set1_epi32(excludeBody);
+	const __m512i step     = _mm512_set1_epi32(16);
+	__m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+	__m512 fx = _mm512_setzero_ps();
+	__m512 fy = _mm512_setzero_ps();
+	__m512 fz = _mm512_setzero_ps();
+	__m512 pot = _mm512_setzero_ps();
+
+	for (int j = 0; j < nBodies; j += 16) {
+		__m512 dx = _mm512_sub_ps(_mm512_load_ps(soa->x + j), px);
+		__m512 dy = _mm512_sub_ps(_mm512_load_ps(soa->y + j), py);
+		__m512 dz = _mm512_sub_ps(_mm512_load_ps(soa->z + j), pz);
+		__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+		__m512 y = _mm512_maskz_rsqrt14_ps(0xffff, r2);
+		y = _mm512_mul_ps(y, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(y, y), threeHalf));
+		__m512 gm    = _mm512_mul_ps(bigG, _mm512_load_ps(soa->mass + j));
+		__m512 scale = _mm512_mul_ps(gm, _mm512_mul_ps(y, _mm512_mul_ps(y, y)));
+
+		__mmask16 keep = _mm512_cmpneq_epi32_mask(idx, exclude) & _mm512_cmplt_epi32_mask(idx, n);
+		scale = _mm512_maskz_mov_ps(keep, scale);
+
+		fx = _mm512_fmadd_ps(dx, scale, fx);
+		fy = _mm512_fmadd_ps(dy, scale, fy);
+		fz = _mm512_fmadd_ps(dz, scale, fz);
+		if (phi != NULL)
+			pot = _mm512_add_ps(pot, _mm512_maskz_mov_ps(keep, _mm512_mul_ps(gm, y)));
+		idx = _mm512_add_epi32(idx, step);
+	}
+
+	float lanes[4][16] __attribute__((aligned(64)));
+	_mm512_store_ps(lanes[0], fx);
+	_mm512_store_ps(lanes[1], fy);
+	_mm512_store_ps(lanes[2], fz);
+	_mm512_store_ps(lanes[3], pot);
+	m3dLoadVector3(ff, 0.0f, 0.0f, 0.0f);
+	float p = 0.0f;
+	for (int k = 0; k < 16; k++) {
+		ff[0] += lanes[0][k];
+		ff[1] += lanes[1][k];
+		ff[2] += lanes[2][k];
+		p     -= lanes[3][k];
+	}
+	if (phi != NULL)
+		*phi = p;
+}
+
+// Triangle and vertex normals for nb_calculateNormals, eight at a time with gathers.  This is deliberately compiled without FMA,
+// and normalizes with a true square root and division, so it rounds exactly as the scalar loops do.
+__attribute__((target("avx2")))
+static void avx2CalculateNormals(M3DVector3f *normals, float *triNormals, sm_model_t *s, M3DVector3f *vertices) {
+	const float *v  = (const float *)vertices;
+	const int   *ix = (const int *)s->indices;
+	float *nx = triNormals;
+	float *ny = nx + s->nTris;
+	float *nz = ny + s->nTris;
+	const __m256  one    = _mm256_set1_ps(1.0f);
+	const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const __m256i three  = _mm256_set1_epi32(3);
+
+	int t = 0;
+	for (; t + 8 <= s->nTris; t += 8) {
+		__m256i i0 = _mm256_mullo_epi32(_mm256_i32gather_epi32(ix + 3*t,     stride, 4), three);
+		__m256i i1 = _mm256_mullo_epi32(_mm256_i32gather_epi32(ix + 3*t + 1, stride, 4), three);
+		__m256i i2 = _mm256_mullo_epi32(_mm256_i32gather_epi32(ix + 3*t + 2, stride, 4), three);
+
+		__m256 x0 = _mm256_i32gather_ps(v,     i0, 4), y0 = _mm256_i32gather_ps(v + 1, i0, 4), z0 = _mm256_i32gather_ps(v + 2, i0, 4);
+		__m256 ax = _mm256_sub_ps(_mm256_i32gather_ps(v,     i1, 4), x0);
+		__m256 ay = _mm256_sub_ps(_mm256_i32gather_ps(v + 1, i1, 4), y0);
+		__m256 az = _mm256_sub_ps(_mm256_i32gather_ps(v + 2, i1, 4), z0);
+		__m256 bx = _mm256_sub_ps(_mm256_i32gather_ps(v,     i2, 4), x0);
+		__m256 by = _mm256_sub_ps(_mm256_i32gather_ps(v + 1, i2, 4), y0);
+		__m256 bz = _mm256_sub_ps(_mm256_i32gather_ps(v + 2, i2, 4), z0);
+
+		__m256 cx = _mm256_sub_ps(_mm256_mul_ps(ay, bz), _mm256_mul_ps(by, az));
+		__m256 cy = _mm256_sub_ps(_mm256_mul_ps(bx, az), _mm256_mul_ps(ax, bz));
+		__m256 cz = _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(bx, ay));
+		__m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, cx), _mm256_mul_ps(cy, cy)), _mm256_mul_ps(cz, cz));
+		__m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(l2));
+
+		_mm256_storeu_ps(nx + t, _mm256_mul_ps(cx, inv));
+		_mm256_storeu_ps(ny + t, _mm256_mul_ps(cy, inv));
+		_mm256_storeu_ps(nz + t, _mm256_mul_ps(cz, inv));
+	}
+	for (; t < s->nTris; t++) {
+		M3DVector3f dv1, dv2, n;
+		m3dSubtractVectors3(dv1, vertices[s->indices[3*t + 1]], vertices[s->indices[3*t]]);
+		m3dSubtractVectors3(dv2, vertices[s->indices[3*t + 2]], vertices[s->indices[3*t]]);
+		m3dCrossProduct3(n, dv1, dv2);
+		m3dNormalizeVector3(n);
+		nx[t] = n[0];
+		ny[t] = n[1];
+		nz[t] = n[2];
+	}
+
+	// Vertices have different numbers of triangles, so lanes drop out as they run out.
+	int i = 0;
+	for (; i + 8 <= s->nVertices; i += 8) {
+		__m256i start = _mm256_loadu_si256((const __m256i *)(s->adjStart + i));
+		__m256i count = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(s->adjStart + i + 1)), start);
+		__m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps(), sz = _mm256_setzero_ps();
+
+		for (int k = 0; ; k++) {
+			__m256i active = _mm256_cmpgt_epi32(count, _mm256_set1_epi32(k));
+			if (_mm256_testz_si256(active, active))
+				break;
+			__m256 mask = _mm256_castsi256_ps(active);
+			__m256i tri = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), s->adjTris, _mm256_add_epi32(start, _mm256_set1_epi32(k)), active, 4);
+			sx = _mm256_blendv_ps(sx, _mm256_add_ps(sx, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), nx, tri, mask, 4)), mask);
+			sy = _mm256_blendv_ps(sy, _mm256_add_ps(sy, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), ny, tri, mask, 4)), mask);
+			sz = _mm256_blendv_ps(sz, _mm256_add_ps(sz, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), nz, tri, mask, 4)), mask);
+		}
+
+		__m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz));
+		__m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(l2));
+		float out[3][8] __attribute__((aligned(32)));
+		_mm256_store_ps(out[0], _mm256_mul_ps(sx, inv));
+		_mm256_store_ps(out[1], _mm256_mul_ps(sy, inv));
+		_mm256_store_ps(out[2], _mm256_mul_ps(sz, inv));
+		for (int k = 0; k < 8; k++)
+			m3dLoadVector3(normals[i + k], out[0][k], out[1][k], out[2][k]);
+	}
+	for (; i < s->nVertices; i++) {
+		M3DVector3f n;
+		m3dLoadVector3(n, 0.0f, 0.0f, 0.0f);
+		for (int k = s->adjStart[i]; k < s->adjStart[i + 1]; k++) {
+			n[0] += nx[s->adjTris[k]];
+			n[1] += ny[s->adjTris[k]];
+			n[2] += nz[s->adjTris[k]];
+		}
+		m3dNormalizeVector3(n);
+		m3dCopyVector3(normals[i], n);
+	}
+}
+
+nb_simd_t nb_getCpuSimd() {
+	static nb_simd_t level = NB_SIMD_BEST;
+	if (level == NB_SIMD_BEST) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			level = NB_SIMD_AVX512;
+		else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			level = NB_SIMD_AVX2;
+		else
+			level = NB_SIMD_NONE;
+	}
+	return level;
+}
+
+// Returns false if neither the CPU nor the requested level allow a vector kernel, in which case the caller uses the scalar loop.
+// phi, if not NULL, gets the potential per unit mass at pos as well.
+bool nb_simdForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_soa_t *soa, int nBodies, int excludeBody, nb_simd_t level) {
+	nb_simd_t cpu = nb_getCpuSimd();
+	if (level > cpu)
+		level = cpu;
+
+	switch (level) {
+	case NB_SIMD_AVX512:
+		avx512ForceFieldAt(ff, phi, pos, soa, nBodies, excludeBody);
+		return true;
+	case NB_SIMD_AVX2:
+		avx2ForceFieldAt(ff, phi, pos, soa, nBodies, excludeBody);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Returns false if the CPU or the requested level don't allow AVX2, in which case the caller uses the scalar loops.
+// There is no AVX-512 kernel, so that level uses AVX2.
+bool nb_simdCalculateNormals(M3DVector3f *normals, float *triNormals, sm_model_t *s, M3DVector3f *vertices, nb_simd_t level) {
+	nb_simd_t cpu = nb_getCpuSimd();
+	if (level > cpu)
+		level = cpu;
+	if (level < NB_SIMD_AVX2)
+		return false;
+	avx2CalculateNormals(normals, triNormals, s, vertices);
+	return true;
+}
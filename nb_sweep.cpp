@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nbody.h"
+
+// Sweep and prune along one axis.  Each body covers the interval [x - r * scale, x + r * scale], and the intervals are kept sorted
+// by their lower ends from one call to the next.  Bodies only move a little between sub-steps, so the insertion sort
+// that restores the order is close to O(N).
+
+typedef struct {
+	float key;
+	int   body;
+} sortEntry_t;
+
+static int compareEntries(const void *a, const void *b) {
+	const sortEntry_t *ea = (const sortEntry_t *)a;
+	const sortEntry_t *eb = (const sortEntry_t *)b;
+	return (ea->key < eb->key) ? -1 : (ea->key > eb->key) ? 1 : ea->body - eb->body;
+}
+
+static int comparePairs(const void *a, const void *b) {
+	const int *pa = (const int *)a;
+	const int *pb = (const int *)b;
+	return (pa[0] != pb[0]) ? pa[0] - pb[0] : pa[1] - pb[1];
+}
+
+static void addCandidate(nb_sweep_t *sweep, int i, int j) {
+	if (sweep->nCandidates == sweep->maxCandidates) {
+		sweep->maxCandidates = (sweep->maxCandidates == 0) ? 64 : sweep->maxCandidates * 2;
+		sweep->candidates = (int *)realloc(sweep->candidates, sweep->maxCandidates * 2 * sizeof(int));
+	}
+	sweep->candidates[2 * sweep->nCandidates]     = (i < j) ? i : j;
+	sweep->candidates[2 * sweep->nCandidates + 1] = (i < j) ? j : i;
+	sweep->nCandidates++;
+}
+
+// The first call sorts from scratch along the axis the bodies are most spread out on.  That axis is kept afterwards, as
+// changing it would throw the order away.
+static void startSweep(nb_sweep_t *sweep, nb_world_t *world, int slot) {
+	sweep->nBodies = world->nBodies;
+	sweep->order = (int *)malloc(world->nBodies * sizeof(int));
+	sweep->lo    = (float *)malloc(world->nBodies * sizeof(float));
+	sweep->hi    = (float *)malloc(world->nBodies * sizeof(float));
+
+	float best = -1.0f;
+	for (int k = 0; k < 3; k++) {
+		float lo = 0.0f, hi = 0.0f;
+		for (int i = 0; i < world->nBodies; i++) {
+			float x = world->getPVA(slot, i)->position[k];
+			if (i == 0 || x < lo) lo = x;
+			if (i == 0 || x > hi) hi = x;
+		}
+		if (hi - lo > best) {
+			best = hi - lo;
+			sweep->axis = k;
+		}
+	}
+
+	sortEntry_t *entries = (sortEntry_t *)malloc(world->nBodies * sizeof(sortEntry_t));
+	for (int i = 0; i < world->nBodies; i++) {
+		entries[i].key  = world->getPVA(slot, i)->position[sweep->axis];
+		entries[i].body = i;
+	}
+	qsort(entries, world->nBodies, sizeof(sortEntry_t), compareEntries);
+	for (int i = 0; i < world->nBodies; i++)
+		sweep->order[i] = entries[i].body;
+	free(entries);
+}
+
+// Candidate pairs (i, j > i) whose extents overlap, sorted by i then j, into sweep->candidates.
+void nb_sweepCandidates(nb_world_t *world, int slot, float scale) {
+	if (world->sweep == NULL)
+		world->sweep = (nb_sweep_t *)calloc(1, sizeof(nb_sweep_t));
+	nb_sweep_t *sweep = world->sweep;
+	if (sweep->order == NULL)
+		startSweep(sweep, world, slot);
+
+	int n = world->nBodies;
+	for (int k = 0; k < n; k++) {
+		int i = sweep->order[k];
+		float x = world->getPVA(slot, i)->position[sweep->axis];
+		float r = world->bodies[i].radius * scale;
+		sweep->lo[k] = x - r;
+		sweep->hi[k] = x + r;
+	}
+
+	for (int k = 1; k < n; k++) {
+		int   body = sweep->order[k];
+		float lo   = sweep->lo[k];
+		float hi   = sweep->hi[k];
+		int m = k;
+		for (; m > 0 && sweep->lo[m - 1] > lo; m--) {
+			sweep->order[m] = sweep->order[m - 1];
+			sweep->lo[m]    = sweep->lo[m - 1];
+			sweep->hi[m]    = sweep->hi[m - 1];
+		}
+		sweep->order[m] = body;
+		sweep->lo[m]    = lo;
+		sweep->hi[m]    = hi;
+	}
+
+	// Pairs that overlap along the sweep axis are also pruned on the other two, which is cheap as the positions are at hand.
+	int a1 = (sweep->axis + 1) % 3;
+	int a2 = (sweep->axis + 2) % 3;
+	sweep->nCandidates = 0;
+	for (int k = 0; k < n; k++) {
+		int i = sweep->order[k];
+		float *pi = world->getPVA(slot, i)->position;
+		for (int m = k + 1; m < n && sweep->lo[m] <= sweep->hi[k]; m++) {
+			int j = sweep->order[m];
+			float *pj = world->getPVA(slot, j)->position;
+			float reach = (world->bodies[i].radius + world->bodies[j].radius) * scale;
+			if (fabsf(pi[a1] - pj[a1]) <= reach && fabsf(pi[a2] - pj[a2]) <= reach)
+				addCandidate(sweep, i, j);
+		}
+	}
+	qsort(sweep->candidates, sweep->nCandidates, 2 * sizeof(int), comparePairs);
+}
+
+void nb_freeSweep(nb_sweep_t *sweep) {
+	if (sweep == NULL)
+		return;
+	free(sweep->order);
+	free(sweep->lo);
+	free(sweep->hi);
+	free(sweep->candidates);
+	free(sweep);
+}
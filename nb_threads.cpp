@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "nbody.h"
+
+// A fixed set of worker threads that sleep between jobs.
+// A job is a function run once for every task number 0 .. nThreads - 1.  The calling thread runs task 0 itself.
+struct nb_pool {
+	int nThreads;
+	pthread_t *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	pthread_cond_t  done;
+
+	nb_taskFn_t fn;
+	void       *ctx;
+	unsigned    generation;  // Incremented for each job, so workers can tell a new job from a spurious wakeup.
+	int         busy;        // Workers still running the current job.
+	bool        quit;
+};
+
+typedef struct {
+	nb_pool_t *pool;
+	int        task;
+} poolWorker_t;
+
+static void *poolWorker(void *arg) {
+	poolWorker_t *w = (poolWorker_t *)arg;
+	nb_pool_t *pool = w->pool;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->quit)
+			break;
+
+		seen = pool->generation;
+		nb_taskFn_t fn = pool->fn;
+		void *ctx = pool->ctx;
+		pthread_mutex_unlock(&pool->lock);
+
+		fn(ctx, w->task, pool->nThreads);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(w);
+	return NULL;
+}
+
+nb_pool_t *nb_createPool(int nThreads) {
+	nb_pool_t *pool = (nb_pool_t *)calloc(1, sizeof(nb_pool_t));
+	pool->nThreads = (nThreads < 1) ? 1 : (nThreads > NB_MAX_THREADS) ? NB_MAX_THREADS : nThreads;
+	pool->threads  = (pthread_t *)calloc(pool->nThreads, sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (int i = 1; i < pool->nThreads; i++) {
+		poolWorker_t *w = (poolWorker_t *)malloc(sizeof(poolWorker_t));
+		w->pool = pool;
+		w->task = i;
+		if (pthread_create(&pool->threads[i], NULL, poolWorker, w) != 0) {
+			printf("Couldn't create worker thread %d\n", i);
+			exit(-1);
+		}
+	}
+	return pool;
+}
+
+void nb_freePool(nb_pool_t *pool) {
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->nThreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+int nb_poolThreads(nb_pool_t *pool) {
+	return pool->nThreads;
+}
+
+// Run fn(ctx, task, nThreads) for every task, and wait for them all to finish.
+void nb_poolRun(nb_pool_t *pool, nb_taskFn_t fn, void *ctx) {
+	pthread_mutex_lock(&pool->lock);
+	pool->fn   = fn;
+	pool->ctx  = ctx;
+	pool->busy = pool->nThreads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(ctx, 0, pool->nThreads);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Contiguous share of n items for one task.  Every task gets a fixed range, so the work done for any item
+// never depends on which thread happens to be fastest.
+void nb_taskRange(int n, int task, int nTasks, int &begin, int &end) {
+	begin = (int)((long)n * task / nTasks);
+	end   = (int)((long)n * (task + 1) / nTasks);
+}
@@ -0,0 +1,276 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nbody.h"
+
+// Records positions and velocities of some bodies every few sub-steps.  nb_integrate only copies each frame into the
+// buffer being filled.  When it is full, a writer thread encodes and writes it while the other buffer fills, so the
+// integration only waits if the disk falls a whole buffer behind.
+//
+// The file is a header followed by chunks:
+//   header:  char magic[8] "NBTRAJ", uint32 version, uint32 flags, uint32 decimation, uint32 nSelected,
+//            float positionQuantum, float velocityQuantum, int32 bodies[nSelected]
+//   chunk:   uint32 nFrames, uint32 nBytes, then nBytes of:
+//            float t[nFrames]
+//            six columns, x y z vx vy vz, each holding every selected body's values for all nFrames in turn.
+// Values are float bits, or, if the quantum for them is positive, int32 multiples of the quantum.  With
+// NB_TRAJECTORY_DELTA, each is instead the difference from the same body's previous value in the chunk, as a 32 bit
+// wrapping difference zigzag encoded into 1 to 5 bytes of 7 bits, low bits first.  Each chunk decodes on its own.
+
+#define TRAJECTORY_MAGIC   "NBTRAJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_COLUMNS 6
+
+struct nb_trajectory {
+	FILE *f;
+	nb_trajectorySettings_t settings;
+	int  *selected;
+	int   nSelected;
+	int   subSteps;  // Since the last recorded frame.
+
+	// Each buffer holds t[framesPerChunk], then the columns, each nSelected series of framesPerChunk values.
+	float   *buffers[2];
+	int      nFrames[2];
+	int      filling;     // Buffer nb_integrate copies into.
+	uint8_t *encoded;
+
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;    // A buffer is waiting to be written, or it's time to quit.
+	pthread_cond_t  written;  // The writer has finished with a buffer.
+	int  pending;             // Buffer waiting for the writer, or -1.
+	bool quit;
+	bool failed;
+	int  stalls;
+};
+
+static uint32_t valueBits(float v, float quantum) {
+	if (quantum <= 0.0f) {
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return bits;
+	}
+	float q = v / quantum;
+	if (q >  2147483520.0f) q =  2147483520.0f;  // The largest float below 2^31.
+	if (q < -2147483648.0f) q = -2147483648.0f;
+	return (uint32_t)(int32_t)lrintf(q);
+}
+
+static uint8_t *putVarint(uint8_t *p, uint32_t u) {
+	while (u >= 0x80) {
+		*p++ = (uint8_t)(u | 0x80);
+		u >>= 7;
+	}
+	*p++ = (uint8_t)u;
+	return p;
+}
+
+static size_t encodeChunk(nb_trajectory_t *traj, const float *buffer, int nFrames) {
+	int perChunk = traj->settings.framesPerChunk;
+	uint8_t *p = traj->encoded + 2 * sizeof(uint32_t);
+	memcpy(p, buffer, nFrames * sizeof(float));
+	p += nFrames * sizeof(float);
+
+	for (int c = 0; c < TRAJECTORY_COLUMNS; c++) {
+		float quantum = (c < 3) ? traj->settings.positionQuantum : traj->settings.velocityQuantum;
+		for (int s = 0; s < traj->nSelected; s++) {
+			const float *series = &buffer[perChunk * (1 + c * traj->nSelected + s)];
+			uint32_t prev = 0;
+			for (int f = 0; f < nFrames; f++) {
+				uint32_t u = valueBits(series[f], quantum);
+				if (traj->settings.delta) {
+					uint32_t d = u - prev;
+					prev = u;
+					p = putVarint(p, (d << 1) ^ (uint32_t)((int32_t)d >> 31));
+				}
+				else {
+					memcpy(p, &u, sizeof(u));
+					p += sizeof(u);
+				}
+			}
+		}
+	}
+
+	uint32_t sizes[2] = { (uint32_t)nFrames, (uint32_t)(p - traj->encoded - 2 * sizeof(uint32_t)) };
+	memcpy(traj->encoded, sizes, sizeof(sizes));
+	return p - traj->encoded;
+}
+
+static void *trajectoryWriter(void *arg) {
+	nb_trajectory_t *traj = (nb_trajectory_t *)arg;
+
+	pthread_mutex_lock(&traj->lock);
+	for (;;) {
+		while (traj->pending < 0 && !traj->quit)
+			pthread_cond_wait(&traj->ready, &traj->lock);
+		if (traj->pending < 0)
+			break;
+
+		int b = traj->pending;
+		pthread_mutex_unlock(&traj->lock);
+
+		size_t size = encodeChunk(traj, traj->buffers[b], traj->nFrames[b]);
+		bool ok = (fwrite(traj->encoded, 1, size, traj->f) == size);
+
+		pthread_mutex_lock(&traj->lock);
+		if (!ok && !traj->failed) {
+			printf("Couldn't write trajectory\n");
+			traj->failed = true;
+		}
+		traj->nFrames[b] = 0;
+		traj->pending = -1;
+		pthread_cond_signal(&traj->written);
+	}
+	pthread_mutex_unlock(&traj->lock);
+	return NULL;
+}
+
+// Hand the buffer being filled to the writer, and carry on with the other one.
+static void flushBuffer(nb_trajectory_t *traj) {
+	pthread_mutex_lock(&traj->lock);
+	if (traj->pending >= 0)
+		traj->stalls++;
+	while (traj->pending >= 0)
+		pthread_cond_wait(&traj->written, &traj->lock);
+	traj->pending = traj->filling;
+	traj->filling = 1 - traj->filling;
+	pthread_cond_signal(&traj->ready);
+	pthread_mutex_unlock(&traj->lock);
+}
+
+static void captureFrame(nb_trajectory_t *traj, nb_world_t *world) {
+	int perChunk = traj->settings.framesPerChunk;
+	int b = traj->filling;
+	int f = traj->nFrames[b];
+	float *buffer = traj->buffers[b];
+
+	buffer[f] = world->t;
+	for (int s = 0; s < traj->nSelected; s++) {
+		nb_pva_t *pva = world->getCurrentPVA(traj->selected[s]);
+		for (int k = 0; k < 3; k++) {
+			buffer[perChunk * (1 + k * traj->nSelected + s) + f]       = pva->position[k];
+			buffer[perChunk * (1 + (k + 3) * traj->nSelected + s) + f] = pva->velocity[k];
+		}
+	}
+
+	if (++traj->nFrames[b] == perChunk)
+		flushBuffer(traj);
+}
+
+void nb_defaultTrajectorySettings(nb_trajectorySettings_t *settings) {
+	settings->decimation      = 1;
+	settings->nSelected       = 0;
+	settings->selected        = NULL;
+	settings->delta           = false;
+	settings->positionQuantum = 0.0f;
+	settings->velocityQuantum = 0.0f;
+	settings->framesPerChunk  = DEFAULT_TRAJECTORY_CHUNK;
+}
+
+// Start recording the world into a new file, beginning with its current state, in place of any earlier recording.
+// nb_integrate then records every decimation'th sub-step until nb_closeTrajectory.
+// Returns NULL, having said why, if the file can't be created.
+nb_trajectory_t *nb_openTrajectory(nb_world_t *world, const char *path, const nb_trajectorySettings_t *settings) {
+	nb_closeTrajectory(world);
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("Couldn't create trajectory %s\n", path);
+		return NULL;
+	}
+
+	nb_trajectory_t *traj = (nb_trajectory_t *)calloc(1, sizeof(nb_trajectory_t));
+	traj->f = f;
+	traj->settings = *settings;
+	if (traj->settings.decimation < 1)
+		traj->settings.decimation = 1;
+	if (traj->settings.framesPerChunk < 1)
+		traj->settings.framesPerChunk = 1;
+
+	traj->nSelected = (settings->nSelected > 0) ? settings->nSelected : world->nBodies;
+	traj->selected = (int *)malloc(traj->nSelected * sizeof(int));
+	for (int s = 0; s < traj->nSelected; s++) {
+		traj->selected[s] = (settings->nSelected > 0) ? settings->selected[s] : s;
+		if (traj->selected[s] < 0 || traj->selected[s] >= world->nBodies) {
+			printf("No body %d to record\n", traj->selected[s]);
+			exit(-1);
+		}
+	}
+	traj->settings.selected = traj->selected;
+
+	int perChunk = traj->settings.framesPerChunk;
+	size_t values = (size_t)perChunk * (1 + TRAJECTORY_COLUMNS * traj->nSelected);
+	traj->buffers[0] = (float *)malloc(values * sizeof(float));
+	traj->buffers[1] = (float *)malloc(values * sizeof(float));
+	traj->encoded    = (uint8_t *)malloc(2 * sizeof(uint32_t) + values * 5);  // Varints take at most 5 bytes.
+	traj->pending = -1;
+
+	uint32_t header[4] = { TRAJECTORY_VERSION, traj->settings.delta ? NB_TRAJECTORY_DELTA : 0u,
+	                       (uint32_t)traj->settings.decimation, (uint32_t)traj->nSelected };
+	float quanta[2] = { traj->settings.positionQuantum, traj->settings.velocityQuantum };
+	char magic[8] = TRAJECTORY_MAGIC;
+	if (fwrite(magic, 1, sizeof(magic), f) != sizeof(magic) || fwrite(header, sizeof(uint32_t), 4, f) != 4 ||
+	    fwrite(quanta, sizeof(float), 2, f) != 2 || fwrite(traj->selected, sizeof(int), traj->nSelected, f) != (size_t)traj->nSelected) {
+		printf("Couldn't write trajectory\n");
+		traj->failed = true;
+	}
+
+	pthread_mutex_init(&traj->lock, NULL);
+	pthread_cond_init(&traj->ready, NULL);
+	pthread_cond_init(&traj->written, NULL);
+	if (pthread_create(&traj->thread, NULL, trajectoryWriter, traj) != 0) {
+		printf("Couldn't create trajectory writer thread\n");
+		exit(-1);
+	}
+
+	captureFrame(traj, world);
+	world->trajectory = traj;
+	return traj;
+}
+
+// Called by nb_integrate after every sub-step.
+void nb_recordTrajectory(nb_trajectory_t *traj, nb_world_t *world) {
+	if (++traj->subSteps < traj->settings.decimation)
+		return;
+	traj->subSteps = 0;
+	captureFrame(traj, world);
+}
+
+// Write whatever is left, and stop recording.  Returns false if anything couldn't be written.
+bool nb_closeTrajectory(nb_world_t *world) {
+	nb_trajectory_t *traj = world->trajectory;
+	if (traj == NULL)
+		return true;
+	world->trajectory = NULL;
+
+	if (traj->nFrames[traj->filling] > 0)
+		flushBuffer(traj);
+
+	pthread_mutex_lock(&traj->lock);
+	traj->quit = true;
+	pthread_cond_signal(&traj->ready);
+	pthread_mutex_unlock(&traj->lock);
+	pthread_join(traj->thread, NULL);
+
+	bool ok = !traj->failed;
+	if (fclose(traj->f) != 0) {
+		printf("Couldn't write trajectory\n");
+		ok = false;
+	}
+	if (traj->stalls > 0)
+		printf("Trajectory writer fell behind %d times\n", traj->stalls);
+
+	pthread_cond_destroy(&traj->written);
+	pthread_cond_destroy(&traj->ready);
+	pthread_mutex_destroy(&traj->lock);
+	free(traj->buffers[0]);
+	free(traj->buffers[1]);
+	free(traj->encoded);
+	free(traj->selected);
+	free(traj);
+	return ok;
+}
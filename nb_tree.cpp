@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nbody.h"
+
+// Cells holding more than LEAF_SIZE bodies are split, unless they are already MAX_DEPTH deep.
+// The depth limit stops coincident bodies from splitting forever.
+#define LEAF_SIZE 8
+#define MAX_DEPTH 32
+
+static int allocNodes(nb_tree_t *tree, int n) {
+	if (tree->nNodes + n > tree->maxNodes) {
+		tree->maxNodes = (tree->nNodes + n) * 2;
+		tree->nodes = (nb_treeNode_t *)realloc(tree->nodes, tree->maxNodes * sizeof(nb_treeNode_t));
+	}
+	int first = tree->nNodes;
+	tree->nNodes += n;
+	return first;
+}
+
+static inline int getOctant(nb_treeNode_t *node, M3DVector3f pos) {
+	return ((pos[0] >= node->center[0]) ? 1 : 0) |
+	       ((pos[1] >= node->center[1]) ? 2 : 0) |
+	       ((pos[2] >= node->center[2]) ? 4 : 0);
+}
+
+static void initNode(nb_treeNode_t *node, float cx, float cy, float cz, float halfSize) {
+	m3dLoadVector3(node->center, cx, cy, cz);
+	node->halfSize   = halfSize;
+	m3dLoadVector3(node->com, 0.0f, 0.0f, 0.0f);
+	node->mass       = 0.0f;
+	node->firstChild = -1;
+	node->firstBody  = -1;
+	node->nBodies    = 0;
+}
+
+static inline void addToLeaf(nb_tree_t *tree, int n, int body) {
+	tree->nextBody[body]     = tree->nodes[n].firstBody;
+	tree->nodes[n].firstBody = body;
+	tree->nodes[n].nBodies++;
+}
+
+// Split leaf n, and any of the new leaves that are still too full, depth first.
+static void splitLeaf(nb_tree_t *tree, nb_world_t *world, int slot, int n, int depth) {
+	int stack[8 * MAX_DEPTH][2];
+	int top = 0;
+	stack[top][0] = n;
+	stack[top][1] = depth;
+	top++;
+
+	while (top > 0) {
+		top--;
+		n     = stack[top][0];
+		depth = stack[top][1];
+		if (tree->nodes[n].nBodies <= LEAF_SIZE || depth >= MAX_DEPTH)
+			continue;
+
+		// Note that allocNodes may move the node array, so we can't hold on to pointers into it.
+		int first = allocNodes(tree, 8);
+		float h = tree->nodes[n].halfSize / 2.0f;
+		for (int i = 0; i < 8; i++) {
+			initNode(&tree->nodes[first + i],
+			         tree->nodes[n].center[0] + ((i & 1) ? h : -h),
+			         tree->nodes[n].center[1] + ((i & 2) ? h : -h),
+			         tree->nodes[n].center[2] + ((i & 4) ? h : -h),
+			         h);
+		}
+
+		int body = tree->nodes[n].firstBody;
+		tree->nodes[n].firstChild = first;
+		tree->nodes[n].firstBody  = -1;
+		tree->nodes[n].nBodies    = 0;
+
+		while (body != -1) {
+			int next = tree->nextBody[body];
+			addToLeaf(tree, first + getOctant(&tree->nodes[n], world->getPVA(slot, body)->position), body);
+			body = next;
+		}
+
+		// In reverse, so the first child is split first.
+		for (int i = 7; i >= 0; i--) {
+			stack[top][0] = first + i;
+			stack[top][1] = depth + 1;
+			top++;
+		}
+	}
+}
+
+static void insertBody(nb_tree_t *tree, nb_world_t *world, int slot, int body) {
+	float *pos = world->getPVA(slot, body)->position;
+	int n = 0;
+	int depth = 0;
+	while (tree->nodes[n].firstChild != -1) {
+		n = tree->nodes[n].firstChild + getOctant(&tree->nodes[n], pos);
+		depth++;
+	}
+
+	addToLeaf(tree, n, body);
+	if (tree->nodes[n].nBodies > LEAF_SIZE && depth < MAX_DEPTH)
+		splitLeaf(tree, world, slot, n, depth);
+}
+
+// Copy each leaf's bodies into the packed arrays, so the walk reads them in order, and fill in the mass and center of
+// mass of every cell.  Children always come after their parent in the node array, so going backwards is bottom up.
+static void packLeaves(nb_tree_t *tree, nb_world_t *world, int slot) {
+	if (tree->nPacked < world->nBodies) {
+		tree->nPacked = world->nBodies;
+		tree->packed  = (nb_treeBody_t *)realloc(tree->packed, tree->nPacked * sizeof(nb_treeBody_t));
+	}
+
+	int k = 0;
+	for (int n = 0; n < tree->nNodes; n++) {
+		nb_treeNode_t *node = &tree->nodes[n];
+		if (node->firstChild != -1)
+			continue;
+		int b = node->firstBody;
+		node->firstBody = k;
+		for (; b != -1; b = tree->nextBody[b]) {
+			m3dCopyVector3(tree->packed[k].position, world->getPVA(slot, b)->position);
+			tree->packed[k].mass = world->bodies[b].mass;
+			tree->packed[k].body = b;
+			k++;
+		}
+	}
+
+	for (int n = tree->nNodes - 1; n >= 0; n--) {
+		nb_treeNode_t *node = &tree->nodes[n];
+		M3DVector3f com;
+		float mass = 0.0f;
+		m3dLoadVector3(com, 0.0f, 0.0f, 0.0f);
+
+		if (node->firstChild == -1) {
+			for (int b = node->firstBody; b < node->firstBody + node->nBodies; b++) {
+				float *pos = tree->packed[b].position;
+				com[0] += pos[0] * tree->packed[b].mass;
+				com[1] += pos[1] * tree->packed[b].mass;
+				com[2] += pos[2] * tree->packed[b].mass;
+				mass   += tree->packed[b].mass;
+			}
+		}
+		else {
+			for (int i = 0; i < 8; i++) {
+				nb_treeNode_t *child = &tree->nodes[node->firstChild + i];
+				com[0] += child->com[0] * child->mass;
+				com[1] += child->com[1] * child->mass;
+				com[2] += child->com[2] * child->mass;
+				mass   += child->mass;
+			}
+		}
+
+		if (mass > 0.0f)
+			m3dScaleVector3(com, 1.0f/mass);
+		else
+			m3dCopyVector3(com, node->center);
+		m3dCopyVector3(node->com, com);
+		node->mass = mass;
+	}
+}
+
+void nb_buildTree(nb_world_t *world, int slot) {
+	if (world->tree == NULL)
+		world->tree = (nb_tree_t *)calloc(1, sizeof(nb_tree_t));
+	nb_tree_t *tree = world->tree;
+
+	if (tree->nBodyLinks < world->nBodies) {
+		tree->nBodyLinks = world->nBodies;
+		tree->nextBody = (int *)realloc(tree->nextBody, tree->nBodyLinks * sizeof(int));
+	}
+
+	// Root cell is the smallest cube that contains every body.
+	M3DVector3f lo, hi;
+	m3dLoadVector3(lo, 0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(hi, 0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < world->nBodies; i++) {
+		float *pos = world->getPVA(slot, i)->position;
+		for (int k = 0; k < 3; k++) {
+			if (i == 0 || pos[k] < lo[k]) lo[k] = pos[k];
+			if (i == 0 || pos[k] > hi[k]) hi[k] = pos[k];
+		}
+	}
+	float halfSize = 0.0f;
+	for (int k = 0; k < 3; k++) {
+		if ((hi[k] - lo[k]) / 2.0f > halfSize)
+			halfSize = (hi[k] - lo[k]) / 2.0f;
+	}
+	halfSize = halfSize * 1.001f + 1e-6f;  // So bodies on the boundary are safely inside.
+
+	tree->nNodes = 0;
+	allocNodes(tree, 1);
+	initNode(&tree->nodes[0], (lo[0] + hi[0])/2.0f, (lo[1] + hi[1])/2.0f, (lo[2] + hi[2])/2.0f, halfSize);
+
+	for (int i = 0; i < world->nBodies; i++)
+		insertBody(tree, world, slot, i);
+	packLeaves(tree, world, slot);
+
+	tree->slot  = slot;
+	tree->t     = world->t;
+	tree->valid = true;
+}
+
+static inline bool cellContains(nb_treeNode_t *node, M3DVector3f pos) {
+	return fabsf(pos[0] - node->center[0]) <= node->halfSize &&
+	       fabsf(pos[1] - node->center[1]) <= node->halfSize &&
+	       fabsf(pos[2] - node->center[2]) <= node->halfSize;
+}
+
+static inline void addAttraction(M3DVector3f ff, M3DVector3f pos, M3DVector3f source, float mass) {
+	M3DVector3f temp;
+	m3dSubtractVectors3(temp, source, pos);
+	float r = m3dGetVectorLength3(temp);
+	float scale = BIGG*mass/(r*r*r);
+	m3dScaleVector3(temp, scale);
+	m3dAddVectors3(ff, ff, temp);
+}
+
+static inline void addPotential(float *phi, M3DVector3f pos, M3DVector3f source, float mass) {
+	M3DVector3f temp;
+	m3dSubtractVectors3(temp, source, pos);
+	*phi -= BIGG*mass/m3dGetVectorLength3(temp);
+}
+
+// Field and potential at pos using the tree built by nb_buildTree.  Either may be NULL.
+// A cell is treated as a point mass if its size is less than theta times its distance from pos.
+// Cells containing pos are always opened, so excludeBody never contributes to its own field.
+static inline void treeWalk(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int excludeBody) {
+	nb_tree_t *tree = world->tree;
+	float theta2 = world->theta * world->theta;
+	if (ff != NULL)
+		m3dLoadVector3(ff, 0.0f, 0.0f, 0.0f);
+	if (phi != NULL)
+		*phi = 0.0f;
+
+	int stack[7 * MAX_DEPTH + 8];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0) {
+		nb_treeNode_t *node = &tree->nodes[stack[--top]];
+		if (node->mass == 0.0f)
+			continue;
+
+		if (node->firstChild == -1) {
+			for (int b = node->firstBody; b < node->firstBody + node->nBodies; b++) {
+				nb_treeBody_t *source = &tree->packed[b];
+				if (source->body == excludeBody)
+					continue;
+				if (ff != NULL)
+					addAttraction(ff, pos, source->position, source->mass);
+				if (phi != NULL)
+					addPotential(phi, pos, source->position, source->mass);
+			}
+			continue;
+		}
+
+		M3DVector3f d;
+		m3dSubtractVectors3(d, node->com, pos);
+		float size = 2.0f * node->halfSize;
+		if (!cellContains(node, pos) && size * size < theta2 * m3dGetVectorLengthSquared3(d)) {
+			if (ff != NULL)
+				addAttraction(ff, pos, node->com, node->mass);
+			if (phi != NULL)
+				addPotential(phi, pos, node->com, node->mass);
+			continue;
+		}
+
+		for (int i = 0; i < 8; i++)
+			stack[top++] = node->firstChild + i;
+	}
+}
+
+void nb_treeForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t *world, int excludeBody) {
+	treeWalk(ff, NULL, pos, world, excludeBody);
+}
+
+// Both at once, for force passes that also want the potential.  phi may be NULL.
+void nb_treeFieldAndPotentialAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int excludeBody) {
+	treeWalk(ff, phi, pos, world, excludeBody);
+}
+
+// Potential per unit mass at pos, approximated in the same way as the field.
+float nb_treePotentialAt(M3DVector3f pos, nb_world_t *world, int excludeBody) {
+	float phi;
+	treeWalk(NULL, &phi, pos, world, excludeBody);
+	return phi;
+}
+
+void nb_freeTree(nb_tree_t *tree) {
+	if (tree == NULL)
+		return;
+	free(tree->nodes);
+	free(tree->nextBody);
+	free(tree->packed);
+	free(tree);
+}
@@ -0,0 +1,367 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nbody.h"
+
+// Checks of the simulation that don't need a display.  Prints each result, and exits with the number that failed.
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    failures++;
+}
+
+nb_world_t *createWorld(const char *name, int nBodies) {
+  for (int i = 0; i < nCreators; i++) {
+    if (strcmp(name, creators[i].name) == 0)
+      return (creators[i].creator)(nBodies, 1);
+  }
+  printf("No world called %s\n", name);
+  exit(-1);
+}
+
+// Pairwise accumulation counts its force evaluations like any other solver.
+void checkPairwiseEvaluations() {
+  nb_world_t *world = createWorld("plummer", 100);
+  world->pairwise = true;
+  world->nSteps   = 1;
+  nb_integrate(world, 0.01f);
+  check(world->nForceEvaluations > 0, "pairwise steps count force evaluations");
+  nb_freeWorld(world);
+}
+
+float treeForceError(float theta) {
+  nb_world_t *world = createWorld("plummer", 1000);
+  world->forceMode = NB_FORCE_TREE;
+  world->theta     = theta;
+  float err = nb_getForceError(world);
+  nb_freeWorld(world);
+  return err;
+}
+
+// The tree's forces get worse as the opening angle grows, and are good to well under a percent at the default.
+void checkTreeForceError() {
+  float e25 = treeForceError(0.25f);
+  float e50 = treeForceError(0.5f);
+  float e100 = treeForceError(1.0f);
+  check(e25 < e50 && e50 < e100, "tree force error rises with theta");
+  check(e50 < 0.01f, "tree force error is under 1% at theta 0.5");
+}
+
+// Largest difference between the field from the SOA layout at the given instruction set and the AOS one, relative to
+// the AOS one.  A fresh world each time, so that nothing it packed is reused.
+float soaFieldError(nb_simd_t simd) {
+  nb_world_t *world = createWorld("plummer", 1000);
+  float err = 0.0f;
+  for (int i = 0; i < world->nBodies; i++) {
+    M3DVector3f aos, soa, diff;
+    world->layout = NB_LAYOUT_AOS;
+    nb_calculateForceFieldAt(aos, world->getCurrentPVA(i)->position, world, i);
+    world->layout = NB_LAYOUT_SOA;
+    world->simd   = simd;
+    nb_calculateForceFieldAt(soa, world->getCurrentPVA(i)->position, world, i);
+    m3dSubtractVectors3(diff, soa, aos);
+    err = fmaxf(err, m3dGetVectorLength3(diff) / m3dGetVectorLength3(aos));
+  }
+  nb_freeWorld(world);
+  return err;
+}
+
+// The vector kernels sum in a different order, so only match the scalar loop to rounding.  Levels the CPU doesn't have
+// fall back to the scalar loop, and so pass trivially.
+void checkSoaLayout() {
+  check(soaFieldError(NB_SIMD_AVX2) < 1e-5f, "SOA layout with AVX2 matches AOS");
+  check(soaFieldError(NB_SIMD_AVX512) < 1e-5f, "SOA layout with AVX-512 matches AOS");
+}
+
+// The vector normals round exactly as the scalar loops do, so must match them bit for bit.  Passes trivially without AVX2.
+void checkSimdNormals() {
+  nb_world_t *world = createWorld("plummer", 50);
+  nb_integrate(world, 0.1f);
+  bool same = true;
+  for (int i = 0; i < world->nBodies; i++) {
+    nb_setDetail(world, i, 3);
+    nb_calculatePercievedForces(world, i);
+    int nVertices = world->bodies[i].unitSphere->nVertices;
+    M3DVector3f *scalar = (M3DVector3f *)malloc(nVertices * sizeof(M3DVector3f));
+    world->simd = NB_SIMD_NONE;
+    nb_calculateNormals(world, i);
+    memcpy(scalar, world->bodies[i].displayNormals, nVertices * sizeof(M3DVector3f));
+    world->simd = NB_SIMD_BEST;
+    nb_calculateNormals(world, i);
+    if (memcmp(scalar, world->bodies[i].displayNormals, nVertices * sizeof(M3DVector3f)) != 0)
+      same = false;
+    free(scalar);
+  }
+  check(same, "SIMD normals match scalar normals");
+  nb_freeWorld(world);
+}
+
+// Largest difference between the accelerations after one step with pairwise accumulation and one without, relative to
+// the latter.
+float pairwiseError(int nThreads) {
+  nb_world_t *direct   = createWorld("plummer", 1000);
+  nb_world_t *pairwise = createWorld("plummer", 1000);
+  pairwise->pairwise = true;
+  direct->nThreads = pairwise->nThreads = nThreads;
+  direct->nSteps   = pairwise->nSteps   = 1;
+  nb_integrate(direct, 0.01f);
+  nb_integrate(pairwise, 0.01f);
+
+  float err = 0.0f;
+  for (int i = 0; i < direct->nBodies; i++) {
+    M3DVector3f diff;
+    float *a = direct->getCurrentPVA(i)->acceleration;
+    m3dSubtractVectors3(diff, pairwise->getCurrentPVA(i)->acceleration, a);
+    err = fmaxf(err, m3dGetVectorLength3(diff) / m3dGetVectorLength3(a));
+  }
+  nb_freeWorld(direct);
+  nb_freeWorld(pairwise);
+  return err;
+}
+
+// Pairwise accumulation only changes the order of the sums, whatever the number of threads.
+void checkPairwise() {
+  check(pairwiseError(1) < 1e-5f, "pairwise matches direct on one thread");
+  check(pairwiseError(4) < 1e-5f, "pairwise matches direct on four threads");
+}
+
+// A loaded world may use different force settings from the one that saved it, so it recalculates its accelerations.
+void checkLoadedAccelerations() {
+  nb_world_t *world = createWorld("plummer", 100);
+  nb_integrate(world, 0.01f);
+  const char *path = "nbcheck.nbw";
+  bool saved = nb_saveWorld(world, path);
+  nb_freeWorld(world);
+  check(saved, "checkpoint saves");
+  if (!saved)
+    return;
+
+  world = nb_loadWorld(path);
+  remove(path);
+  check(world != NULL && !world->accelerationsValid && !world->jerksValid, "loaded worlds recalculate accelerations");
+  if (world != NULL)
+    nb_freeWorld(world);
+}
+
+double relativeDrift(nb_world_t *world, int frames) {
+  nb_diagnostics_t d0, d1;
+  nb_getDiagnostics(&d0, world);
+  for (int f = 0; f < frames; f++)
+    nb_integrate(world, 0.1f);
+  nb_getDiagnostics(&d1, world);
+  return fabs((d1.totalEnergy - d0.totalEnergy) / d0.totalEnergy);
+}
+
+// On a world whose bodies bounce without passing through each other, bouncing at the moment of contact costs no more energy
+// than bouncing at the start of the next sub-step.  Drifts this small are single precision rounding, hence the allowance.
+void checkContinuousImpactDrift(nb_integrator_t integrator, const char *what) {
+  double drift[2];
+  for (int ccd = 0; ccd < 2; ccd++) {
+    nb_world_t *world = createWorld("bounce2b", 0);
+    world->nSteps            = 5;
+    world->integrator        = integrator;
+    world->continuousImpacts = (ccd == 1);
+    drift[ccd] = relativeDrift(world, 300);
+    nb_freeWorld(world);
+  }
+  check(drift[1] <= drift[0] + 1e-5, what);
+}
+
+// A body struck from both sides within one sub-step bounces off each in turn, like the middle ball of Newton's cradle.
+void checkContinuousImpactChain() {
+  nb_world_t *world = nb_createWorld(3);
+  world->radius            = 100.0f;
+  world->stiffness         = 1.0f;
+  world->bounceFudgeFactor = 1.0f;
+  world->nSteps            = 1;
+  world->continuousImpacts = true;
+  float x[3] = { -5.0f, 0.0f, 6.0f };
+  float v[3] = { 60.0f, 0.0f, -60.0f };
+  for (int i = 0; i < 3; i++) {
+    world->bodies[i].mass   = 1e-6f;
+    world->bodies[i].radius = 0.5f;
+    m3dLoadVector3(world->getCurrentPVA(i)->position, x[i], 0.01f * i, 0.0f);
+    m3dLoadVector3(world->getCurrentPVA(i)->velocity, v[i], 0.0f, 0.0f);
+  }
+  nb_integrate(world, 0.1f);
+  nb_integrate(world, 0.1f);
+  check(world->getCurrentPVA(0)->velocity[0] < -59.0f && fabsf(world->getCurrentPVA(1)->velocity[0]) < 1.0f &&
+        world->getCurrentPVA(2)->velocity[0] > 59.0f, "continuous impacts resolve several per body per step");
+  nb_freeWorld(world);
+}
+
+// Mean over bodies of the largest difference in the normal component of perceived force between the two tidal modes,
+// relative to the largest exact one.
+double tidalModeError(nb_world_t *world) {
+  double sum = 0.0;
+  int n = 0;
+  for (int i = 0; i < world->nBodies; i++) {
+    world->tidalMode = NB_TIDAL_EXACT;
+    nb_calculatePercievedForces(world, i);
+    sm_model_t *s = world->bodies[i].unitSphere;
+    float *exact = (float *)malloc(s->nVertices * sizeof(float));
+    float largest = 0.0f;
+    for (int v = 0; v < s->nVertices; v++) {
+      exact[v] = world->bodies[i].pfNormalComponent[v];
+      largest = fmaxf(largest, fabsf(exact[v]));
+    }
+
+    world->tidalMode = NB_TIDAL_TENSOR;
+    nb_calculatePercievedForces(world, i);
+    float err = 0.0f;
+    for (int v = 0; v < s->nVertices; v++)
+      err = fmaxf(err, fabsf(world->bodies[i].pfNormalComponent[v] - exact[v]));
+    free(exact);
+    if (largest > 0.0f) {
+      sum += err / largest;
+      n++;
+    }
+  }
+  return (n > 0) ? sum / n : 0.0;
+}
+
+// Undo the zigzag varint of a delta encoded trajectory value.
+uint32_t getVarint(const uint8_t **p) {
+  uint32_t u = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t b = *(*p)++;
+    u |= (uint32_t)(b & 0x7f) << shift;
+    if (b < 0x80)
+      break;
+  }
+  return (u >> 1) ^ (0u - (u & 1));
+}
+
+// Record a few bodies with deltas and quantized values, several chunks' worth, then decode the file and compare every
+// frame with the states it was recorded from.  The values may only differ by rounding to the quantum.
+void checkTrajectoryRoundTrip() {
+  const char *path = "nbcheck.traj";
+  const int nFrames = 11, selected[3] = { 2, 5, 17 };
+  const float quanta[2] = { 1e-4f, 1e-3f };
+  float expected[nFrames][3][6], times[nFrames];
+
+  nb_world_t *world = createWorld("plummer", 20);
+  world->adaptiveSteps = false;
+  world->nSteps        = 1;
+
+  nb_trajectorySettings_t settings;
+  nb_defaultTrajectorySettings(&settings);
+  settings.decimation      = 2;
+  settings.nSelected       = 3;
+  settings.selected        = selected;
+  settings.delta           = true;
+  settings.positionQuantum = quanta[0];
+  settings.velocityQuantum = quanta[1];
+  settings.framesPerChunk  = 4;
+  if (nb_openTrajectory(world, path, &settings) == NULL) {
+    check(false, "trajectory round trip with deltas and quantization");
+    nb_freeWorld(world);
+    return;
+  }
+  for (int f = 0; f < nFrames; f++) {
+    if (f > 0) {
+      nb_integrate(world, 0.01f);
+      nb_integrate(world, 0.01f);
+    }
+    times[f] = world->t;
+    for (int s = 0; s < 3; s++) {
+      nb_pva_t *pva = world->getCurrentPVA(selected[s]);
+      for (int k = 0; k < 3; k++) {
+        expected[f][s][k]     = pva->position[k];
+        expected[f][s][k + 3] = pva->velocity[k];
+      }
+    }
+  }
+  bool ok = nb_closeTrajectory(world);
+  nb_freeWorld(world);
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    check(false, "trajectory round trip with deltas and quantization");
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  uint8_t *data = (uint8_t *)malloc(size);
+  rewind(file);
+  ok = ok && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+  remove(path);
+
+  // Header: magic, version, flags, decimation, nSelected, the two quanta, then the bodies.
+  uint32_t header[4];
+  float fileQuanta[2];
+  int fileSelected[3];
+  memcpy(header, data + 8, sizeof(header));
+  memcpy(fileQuanta, data + 24, sizeof(fileQuanta));
+  memcpy(fileSelected, data + 32, sizeof(fileSelected));
+  ok = ok && strcmp((const char *)data, "NBTRAJ") == 0 && header[1] == NB_TRAJECTORY_DELTA && header[2] == 2 &&
+       header[3] == 3 && memcmp(fileQuanta, quanta, sizeof(quanta)) == 0 && memcmp(fileSelected, selected, sizeof(selected)) == 0;
+
+  const uint8_t *p = data + 32 + sizeof(selected);
+  int decoded = 0;
+  while (ok && p < data + size) {
+    uint32_t chunk[2];
+    memcpy(chunk, p, sizeof(chunk));
+    p += sizeof(chunk);
+    const uint8_t *end = p + chunk[1];
+    int n = chunk[0];
+    ok = ok && n > 0 && decoded + n <= nFrames && end <= data + size;
+    for (int f = 0; ok && f < n; f++) {
+      float t;
+      memcpy(&t, p, sizeof(t));
+      p += sizeof(t);
+      ok = t == times[decoded + f];
+    }
+    for (int c = 0; ok && c < 6; c++) {
+      float quantum = quanta[c < 3 ? 0 : 1];
+      for (int s = 0; s < 3; s++) {
+        uint32_t u = 0;
+        for (int f = 0; f < n; f++) {
+          u += getVarint(&p);
+          float v = (int32_t)u * quantum;
+          if (fabsf(v - expected[decoded + f][s][c]) > 0.5001f * quantum)
+            ok = false;
+        }
+      }
+    }
+    ok = ok && p == end;
+    decoded += n;
+  }
+  free(data);
+  check(ok && decoded == nFrames, "trajectory round trip with deltas and quantization");
+}
+
+// The tensor's field is a direct sum, so it mustn't take away a uniform pull from the tree's approximate acceleration.
+void checkTidalTensor() {
+  nb_world_t *world = createWorld("plummer", 500);
+  world->forceMode = NB_FORCE_TREE;
+  world->theta     = 0.5f;
+  nb_integrate(world, 0.01f);
+  check(tidalModeError(world) < 0.04, "tidal tensor matches exact tidal forces with tree forces");
+  nb_freeWorld(world);
+}
+
+int main(int argc, char* argv[]) {
+  checkTreeForceError();
+  checkSoaLayout();
+  checkPairwise();
+  checkSimdNormals();
+  checkPairwiseEvaluations();
+  checkLoadedAccelerations();
+  checkContinuousImpactDrift(NB_INTEGRATOR_TRAPEZOID, "continuous impacts don't add drift (trapezoid)");
+  checkContinuousImpactDrift(NB_INTEGRATOR_DOPRI, "continuous impacts don't add drift (dopri)");
+  checkContinuousImpactChain();
+  checkTidalTensor();
+  checkTrajectoryRoundTrip();
+
+  if (failures > 0)
+    printf("%d checks failed\n", failures);
+  return failures;
+}
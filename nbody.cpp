@@ -1,42 +1,332 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "nbody.h"
 
-#define NSLOTS 2
-
 static inline void weightedAccumulate(M3DVector3f a, M3DVector3f v, float weight) {
 	a[0] += v[0] * weight;
 	a[1] += v[1] * weight;
 	a[2] += v[2] * weight;
 }
 
-static void calculateForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t *world, int slot, int excludeBody) {
+// If phi isn't NULL, the potential per unit mass at pos goes there too.  The field is the same either way.
+static void directForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int slot, int excludeBody) {
 	m3dLoadVector3(ff, 0.0f, 0.0f, 0.0f);
+	float p = 0.0f;
 
 	for (int j = 0; j < world->nBodies; j++) {
 		if (j == excludeBody)
 			continue;
 
 		M3DVector3f temp;
-		m3dSubtractVectors3(temp, world->bodies[j].pva[slot].position, pos);
+		m3dSubtractVectors3(temp, world->getPVA(slot, j)->position, pos);
 		float r = m3dGetVectorLength3(temp);
 		float scale = BIGG*world->bodies[j].mass/(r*r*r);
 		m3dScaleVector3(temp, scale);
 		m3dAddVectors3(ff, ff, temp);
+		if (phi != NULL)
+			p -= BIGG*world->bodies[j].mass/r;
+	}
+
+	if (phi != NULL)
+		*phi = p;
+}
+
+// Gather positions and masses of a slot into its structure-of-arrays copy.
+static void packSOA(nb_world_t *world, int slot) {
+	nb_soa_t *soa = &world->soa[slot];
+	nb_pva_t *pva = world->pva[slot];
+	for (int i = 0; i < world->nBodies; i++) {
+		soa->x[i]    = pva[i].position[0];
+		soa->y[i]    = pva[i].position[1];
+		soa->z[i]    = pva[i].position[2];
+		soa->mass[i] = world->bodies[i].mass;
+	}
+	soa->t     = world->t;
+	soa->valid = true;
+}
+
+static inline void soaAccumulate(float &fx, float &fy, float &fz, float *phi, M3DVector3f pos, nb_soa_t *soa, int from, int to) {
+	const float * __restrict__ x = soa->x;
+	const float * __restrict__ y = soa->y;
+	const float * __restrict__ z = soa->z;
+	const float * __restrict__ m = soa->mass;
+	for (int j = from; j < to; j++) {
+		float dx = x[j] - pos[0];
+		float dy = y[j] - pos[1];
+		float dz = z[j] - pos[2];
+		float r = sqrtf(dx*dx + dy*dy + dz*dz);
+		float scale = BIGG*m[j]/(r*r*r);
+		fx += dx * scale;
+		fy += dy * scale;
+		fz += dz * scale;
+		if (phi != NULL)
+			*phi -= BIGG*m[j]/r;
+	}
+}
+
+// Same sums as directForceFieldAt, over the packed arrays.
+// The scalar loop is split around excludeBody so that the inner loops have no branches.
+static void soaForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int slot, int excludeBody) {
+	nb_soa_t *soa = &world->soa[slot];
+	if (world->simd != NB_SIMD_NONE && nb_simdForceFieldAt(ff, phi, pos, soa, world->nBodies, excludeBody, world->simd))
+		return;
+
+	float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+
+	// Separate loops for the potential, so the usual ones stay as they were.
+	if (phi != NULL) {
+		*phi = 0.0f;
+		if (excludeBody >= 0 && excludeBody < world->nBodies) {
+			soaAccumulate(fx, fy, fz, phi, pos, soa, 0, excludeBody);
+			soaAccumulate(fx, fy, fz, phi, pos, soa, excludeBody + 1, world->nBodies);
+		}
+		else {
+			soaAccumulate(fx, fy, fz, phi, pos, soa, 0, world->nBodies);
+		}
+	}
+	else if (excludeBody >= 0 && excludeBody < world->nBodies) {
+		soaAccumulate(fx, fy, fz, NULL, pos, soa, 0, excludeBody);
+		soaAccumulate(fx, fy, fz, NULL, pos, soa, excludeBody + 1, world->nBodies);
+	}
+	else {
+		soaAccumulate(fx, fy, fz, NULL, pos, soa, 0, world->nBodies);
+	}
+
+	m3dLoadVector3(ff, fx, fy, fz);
+}
+
+// The tree or packed arrays, if used, must already have been built for this slot.
+// phi, if not NULL, gets the potential per unit mass at pos, found in the same pass with the same approximations.
+static inline void calculateForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int slot, int excludeBody) {
+	if (world->forceMode == NB_FORCE_TREE)
+		nb_treeFieldAndPotentialAt(ff, phi, pos, world, excludeBody);
+	else if (world->layout == NB_LAYOUT_SOA)
+		soaForceFieldAt(ff, phi, pos, world, slot, excludeBody);
+	else
+		directForceFieldAt(ff, phi, pos, world, slot, excludeBody);
+}
+
+static inline void prepareForceField(nb_world_t *world, int slot) {
+	if (world->forceMode == NB_FORCE_TREE)
+		nb_buildTree(world, slot);
+	else if (world->layout == NB_LAYOUT_SOA)
+		packSOA(world, slot);
+}
+
+// Build the tree or packed arrays for the current slot, unless they are already up to date.
+static void prepareCurrentForceField(nb_world_t *world) {
+	if (world->forceMode == NB_FORCE_TREE) {
+		nb_tree_t *tree = world->tree;
+		if (tree == NULL || !tree->valid || tree->slot != world->current() || tree->t != world->t)
+			nb_buildTree(world, world->current());
+	}
+	else if (world->layout == NB_LAYOUT_SOA) {
+		nb_soa_t *soa = &world->soa[world->current()];
+		if (!soa->valid || soa->t != world->t)
+			packSOA(world, world->current());
 	}
 }
 
 void nb_calculateForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t *world, int excludeBody) {
-	calculateForceFieldAt(ff, pos, world, world->current(), excludeBody);
+	prepareCurrentForceField(world);
+	calculateForceFieldAt(ff, NULL, pos, world, world->current(), excludeBody);
 }
 
 
+// Add the interaction of every pair (i, j) with rowBegin <= i < rowEnd and j > i into acc, and into phi if it isn't NULL.
+// 1/r^3 is calculated once per pair, and applied to both bodies with opposite signs.
+static inline void accumulatePairs(nb_world_t *world, int slot, int rowBegin, int rowEnd, M3DVector3f *acc, float *phi) {
+	nb_pva_t  *pva    = world->pva[slot];
+	nb_body_t *bodies = world->bodies;
+
+	for (int i = rowBegin; i < rowEnd; i++) {
+		float *pi = pva[i].position;
+		float mi  = bodies[i].mass;
+		float ax = 0.0f, ay = 0.0f, az = 0.0f;
+		float p = 0.0f;
+
+		for (int j = i + 1; j < world->nBodies; j++) {
+			float dx = pva[j].position[0] - pi[0];
+			float dy = pva[j].position[1] - pi[1];
+			float dz = pva[j].position[2] - pi[2];
+			float r = sqrtf(dx*dx + dy*dy + dz*dz);
+			float inv3 = BIGG/(r*r*r);
+			float si = bodies[j].mass * inv3;
+			float sj = mi * inv3;
+
+			ax += dx * si;
+			ay += dy * si;
+			az += dz * si;
+			acc[j][0] -= dx * sj;
+			acc[j][1] -= dy * sj;
+			acc[j][2] -= dz * sj;
+			if (phi != NULL) {
+				float inv = BIGG/r;
+				p      -= bodies[j].mass * inv;
+				phi[j] -= mi * inv;
+			}
+		}
+
+		acc[i][0] += ax;
+		acc[i][1] += ay;
+		acc[i][2] += az;
+		if (phi != NULL)
+			phi[i] += p;
+	}
+}
+
+// First row of part `part` of nParts, chosen so each part has about the same number of pairs.
+// Row i has nBodies - 1 - i pairs, so early rows are expensive and the parts shrink towards the end.
+static int pairRowSplit(int nBodies, int nParts, int part) {
+	double total  = (double)nBodies * (nBodies - 1) / 2.0;
+	double target = total * part / nParts;
+	double pairs  = 0.0;
+	int row = 0;
+	while (row < nBodies && pairs < target) {
+		pairs += nBodies - 1 - row;
+		row++;
+	}
+	return row;
+}
+
+// Worlds smaller than this aren't worth waking the workers for.
+#define MIN_PARALLEL_BODIES 64
+
+// Number of tasks to split a job into, if it is worth waking the workers for.
+static int poolTasks(nb_world_t *world, bool worthIt) {
+	int nThreads = (world->nThreads < NB_MAX_THREADS) ? world->nThreads : NB_MAX_THREADS;
+	if (nThreads <= 1 || !worthIt)
+		return 1;
+	if (world->pool == NULL || nb_poolThreads(world->pool) != nThreads) {
+		nb_freePool(world->pool);
+		world->pool = nb_createPool(nThreads);
+	}
+	return nThreads;
+}
+
+// Number of tasks runTasks will split the next job into.
+static int taskCount(nb_world_t *world) {
+	return poolTasks(world, world->nBodies >= MIN_PARALLEL_BODIES);
+}
+
+static void runTasks(nb_world_t *world, nb_taskFn_t fn, void *ctx) {
+	if (taskCount(world) > 1)
+		nb_poolRun(world->pool, fn, ctx);
+	else
+		fn(ctx, 0, 1);
+}
+
+typedef struct {
+	nb_world_t *world;
+	int         slot;
+	int         from;
+	int         to;
+	float       dt;
+	int        *counts;  // One per task, for tasks that count things.
+	float      *potential;  // Where force passes put each body's potential, if they should.
+} stepTask_t;
+
+static void pairTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	M3DVector3f *acc = &world->pairAcc[(size_t)task * world->nBodies];
+	int rowBegin = pairRowSplit(world->nBodies, nTasks, task);
+	int rowEnd   = pairRowSplit(world->nBodies, nTasks, task + 1);
+	memset(acc, 0, world->nBodies * sizeof(M3DVector3f));
+	if (st->potential != NULL) {
+		float *phi = &world->pairPhi[(size_t)task * world->nBodies];
+		memset(phi, 0, world->nBodies * sizeof(float));
+		accumulatePairs(world, st->slot, rowBegin, rowEnd, acc, phi);
+	}
+	else {
+		accumulatePairs(world, st->slot, rowBegin, rowEnd, acc, NULL);
+	}
+}
+
+static void pairReduceTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	nb_pva_t *pva = world->pva[st->slot];
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		m3dLoadVector3(pva[i].acceleration, 0.0f, 0.0f, 0.0f);
+		for (int t = 0; t < world->pairAccThreads; t++)
+			m3dAddVectors3(pva[i].acceleration, pva[i].acceleration, world->pairAcc[(size_t)t * world->nBodies + i]);
+		if (st->potential != NULL) {
+			st->potential[i] = 0.0f;
+			for (int t = 0; t < world->pairAccThreads; t++)
+				st->potential[i] += world->pairPhi[(size_t)t * world->nBodies + i];
+		}
+	}
+}
+
+// Pairwise accumulation.  Each task owns a band of rows and its own accumulator array,
+// so nothing is shared while the pairs are summed.  The accumulators are then added in task order, so
+// the result only depends on the thread count.
+static void calculatePairwiseAccelerations(nb_world_t *world, int slot, float *potential) {
+	int nTasks = taskCount(world);
+	if (world->pairAccThreads != nTasks || world->pairAccBodies < world->nBodies) {
+		free(world->pairAcc);
+		free(world->pairPhi);
+		world->pairAcc = (M3DVector3f *)malloc((size_t)nTasks * world->nBodies * sizeof(M3DVector3f));
+		world->pairPhi = NULL;
+		world->pairAccBodies = world->nBodies;
+	}
+	world->pairAccThreads = nTasks;
+	if (potential != NULL && world->pairPhi == NULL)
+		world->pairPhi = (float *)malloc((size_t)nTasks * world->nBodies * sizeof(float));
+
+	stepTask_t st = { world, slot, 0, 0, 0.0f, NULL, potential };
+	runTasks(world, pairTask, &st);
+	runTasks(world, pairReduceTask, &st);
+}
+
+static void accelerationTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *pva = st->world->pva[st->slot];
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		float *phi = (st->potential != NULL) ? &st->potential[i] : NULL;
+		calculateForceFieldAt(pva[i].acceleration, phi, pva[i].position, st->world, st->slot, i);
+	}
+}
+
+// Where the force pass about to start should leave each body's potential, or NULL if it shouldn't bother.
+// Call finishPotential with the same slot once the pass is done.
+static float *startPotential(nb_world_t *world) {
+	world->potentialSlot = -1;
+	world->potentialPredicted = false;
+	if (!world->potentialFromForces)
+		return NULL;
+	if (world->potential == NULL)
+		world->potential = (float *)malloc(world->nBodies * sizeof(float));
+	return world->potential;
+}
+
+static inline void finishPotential(nb_world_t *world, float *potential, int slot) {
+	if (potential != NULL)
+		world->potentialSlot = slot;
+}
+
 static inline void calculateAccelerations(nb_world_t *world, int slot) {
-	for (int i = 0; i < world->nBodies; i++) {
-		calculateForceFieldAt(world->bodies[i].pva[slot].acceleration, world->bodies[i].pva[slot].position, world, slot, i);
+	float *potential = startPotential(world);
+	if (world->pairwise && world->forceMode == NB_FORCE_DIRECT) {
+		calculatePairwiseAccelerations(world, slot, potential);
 	}
+	else {
+		prepareForceField(world, slot);
+
+		stepTask_t st = { world, slot, 0, 0, 0.0f, NULL, potential };
+		runTasks(world, accelerationTask, &st);
+	}
+	world->nForceEvaluations += world->nBodies;
+	finishPotential(world, potential, slot);
 }
 
 static inline void integrateOneEuler(M3DVector3f f, M3DVector3f i, M3DVector3f ci, float dt) {
@@ -51,65 +341,504 @@ static inline void integrateOneTrapezoid(M3DVector3f f, M3DVector3f i, M3DVector
 	f[2] = i[2] + (ci[2] + cf[2])/2.0f * dt;
 }
 
+static void eulerTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *f = st->world->pva[st->from];
+	nb_pva_t *t = st->world->pva[st->to];
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		integrateOneEuler(t[i].velocity, f[i].velocity, f[i].acceleration, st->dt);
+		integrateOneEuler(t[i].position, f[i].position, f[i].velocity,     st->dt);
+	}
+}
+
+static void trapezoidTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *f = st->world->pva[st->from];
+	nb_pva_t *t = st->world->pva[st->to];
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		integrateOneTrapezoid(t[i].velocity, f[i].velocity, f[i].acceleration, t[i].acceleration, st->dt);
+		integrateOneTrapezoid(t[i].position, f[i].position, f[i].velocity,     t[i].velocity,     st->dt);
+	}
+}
+
 static inline void integrateEuler(nb_world_t *world, float dt, int from, int to) {
 	calculateAccelerations(world, from);
 	
-	for (int i = 0; i < world->nBodies; i++) {
-		integrateOneEuler(world->bodies[i].pva[to].velocity, world->bodies[i].pva[from].velocity, world->bodies[i].pva[from].acceleration, dt);
-		integrateOneEuler(world->bodies[i].pva[to].position, world->bodies[i].pva[from].position, world->bodies[i].pva[from].velocity,     dt);
-	}
+	stepTask_t st = { world, from, from, to, dt };
+	runTasks(world, eulerTask, &st);
 }
 
 static inline void reintegrateTrapezoid(nb_world_t *world, float dt, int from, int to) {
 	calculateAccelerations(world, to);
 	
-	for (int i = 0; i < world->nBodies; i++) {
-		integrateOneTrapezoid(world->bodies[i].pva[to].velocity, world->bodies[i].pva[from].velocity, world->bodies[i].pva[from].acceleration, world->bodies[i].pva[to].acceleration, dt);
-		integrateOneTrapezoid(world->bodies[i].pva[to].position, world->bodies[i].pva[from].position, world->bodies[i].pva[from].velocity,     world->bodies[i].pva[to].velocity,     dt);
+	stepTask_t st = { world, to, from, to, dt };
+	runTasks(world, trapezoidTask, &st);
+}
+
+static void kickDriftTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *f = st->world->pva[st->from];
+	nb_pva_t *t = st->world->pva[st->to];
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		integrateOneEuler(t[i].velocity, f[i].velocity, f[i].acceleration, st->dt/2.0f);
+		integrateOneEuler(t[i].position, f[i].position, t[i].velocity,     st->dt);
 	}
 }
 
-static inline void handleImpacts(nb_world_t *world, int slot) {
-	for (int i = 0; i < world->nBodies; i++) {
-		nb_pva_t *pva_i = &world->bodies[i].pva[slot];
-		
+static void kickTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *t = st->world->pva[st->to];
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		integrateOneEuler(t[i].velocity, t[i].velocity, t[i].acceleration, st->dt/2.0f);
+	}
+}
+
+// Kick-drift-kick leapfrog.  The acceleration at the start of the step is the one calculated at the end of the last step,
+// so there is only one force evaluation per step.
+static inline void integrateLeapfrog(nb_world_t *world, float dt, int from, int to) {
+	if (!world->accelerationsValid)
+		calculateAccelerations(world, from);
+
+	stepTask_t st = { world, to, from, to, dt };
+	runTasks(world, kickDriftTask, &st);
+	calculateAccelerations(world, to);
+	runTasks(world, kickTask, &st);
+	world->accelerationsValid = true;
+	world->jerksValid         = false;
+}
+
+// Acceleration and its time derivative, the jerk, of body i from every other body.  And its potential, if phi isn't NULL.
+static void calculateAccelerationAndJerk(nb_world_t *world, int slot, int i, float *phi) {
+	nb_pva_t *pva = world->pva[slot];
+	M3DVector3f a, jerk;
+	m3dLoadVector3(a,    0.0f, 0.0f, 0.0f);
+	m3dLoadVector3(jerk, 0.0f, 0.0f, 0.0f);
+	float p = 0.0f;
+
+	for (int j = 0; j < world->nBodies; j++) {
+		if (j == i)
+			continue;
+
+		M3DVector3f dp, dv;
+		m3dSubtractVectors3(dp, pva[j].position, pva[i].position);
+		m3dSubtractVectors3(dv, pva[j].velocity, pva[i].velocity);
+		float r2 = m3dGetVectorLengthSquared3(dp);
+		float r = sqrtf(r2);
+		float scale = BIGG*world->bodies[j].mass/(r2*r);
+		float rv = 3.0f * m3dDotProduct3(dp, dv) / r2;
+
+		weightedAccumulate(a, dp, scale);
+		for (int k = 0; k < 3; k++)
+			jerk[k] += (dv[k] - rv * dp[k]) * scale;
+		if (phi != NULL)
+			p -= BIGG*world->bodies[j].mass/r;
+	}
+
+	m3dCopyVector3(pva[i].acceleration, a);
+	m3dCopyVector3(pva[i].jerk, jerk);
+	if (phi != NULL)
+		*phi = p;
+}
+
+static void accelerationAndJerkTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++)
+		calculateAccelerationAndJerk(st->world, st->slot, i, (st->potential != NULL) ? &st->potential[i] : NULL);
+}
+
+static void hermitePredictTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *f = st->world->pva[st->from];
+	nb_pva_t *t = st->world->pva[st->to];
+	float dt = st->dt;
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		for (int k = 0; k < 3; k++) {
+			t[i].position[k] = f[i].position[k] + dt*(f[i].velocity[k] + dt/2.0f*(f[i].acceleration[k] + dt/3.0f*f[i].jerk[k]));
+			t[i].velocity[k] = f[i].velocity[k] + dt*(f[i].acceleration[k] + dt/2.0f*f[i].jerk[k]);
+		}
+	}
+}
+
+static void hermiteCorrectTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_pva_t *f = st->world->pva[st->from];
+	nb_pva_t *t = st->world->pva[st->to];
+	float dt = st->dt;
+	int begin, end;
+	nb_taskRange(st->world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		for (int k = 0; k < 3; k++) {
+			t[i].velocity[k] = f[i].velocity[k] + dt/2.0f*(f[i].acceleration[k] + t[i].acceleration[k]) + dt*dt/12.0f*(f[i].jerk[k] - t[i].jerk[k]);
+			t[i].position[k] = f[i].position[k] + dt/2.0f*(f[i].velocity[k] + t[i].velocity[k]) + dt*dt/12.0f*(f[i].acceleration[k] - t[i].acceleration[k]);
+		}
+	}
+}
+
+// Fourth order Hermite predictor-corrector.  Predict positions and velocities from the Taylor series using the jerk,
+// evaluate acceleration and jerk there, then correct with the Hermite interpolant.
+// The accelerations and jerks at the predicted state are reused to start the next step, and so are the potentials, if found.
+static inline void integrateHermite(nb_world_t *world, float dt, int from, int to) {
+	stepTask_t st = { world, from, from, to, dt };
+	if (!world->accelerationsValid || !world->jerksValid) {
+		runTasks(world, accelerationAndJerkTask, &st);
+		world->nForceEvaluations += world->nBodies;
+	}
+
+	runTasks(world, hermitePredictTask, &st);
+	st.slot = to;
+	st.potential = startPotential(world);
+	runTasks(world, accelerationAndJerkTask, &st);
+	world->nForceEvaluations += world->nBodies;
+	finishPotential(world, st.potential, to);
+	world->potentialPredicted = true;
+	runTasks(world, hermiteCorrectTask, &st);
+	world->accelerationsValid = true;
+	world->jerksValid         = true;
+}
+
+// Block time-steps.  Within a sub-step of length h, body i steps by h / 2^stepLevel.  Times are counted in ticks of
+// h / 2^MAX_BLOCK_LEVEL, and since every body's step divides the sub-step, all bodies are synchronised again at its end.
+#define MAX_BLOCK_LEVEL 20
+#define BLOCK_TICKS     (1 << MAX_BLOCK_LEVEL)
+
+typedef struct {
+	nb_world_t *world;
+	int         tNext;   // Ticks.
+	float       tickDt;
+} blockTask_t;
+
+// Predict every body from its own time to tNext into the next slot.
+static void blockPredictTask(void *ctx, int task, int nTasks) {
+	blockTask_t *bt = (blockTask_t *)ctx;
+	nb_world_t *world = bt->world;
+	nb_pva_t *f = world->pva[world->current()];
+	nb_pva_t *t = world->pva[world->next()];
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		float dt = (bt->tNext - world->bodies[i].blockTime) * bt->tickDt;
+		for (int k = 0; k < 3; k++) {
+			t[i].position[k] = f[i].position[k] + dt*(f[i].velocity[k] + dt/2.0f*(f[i].acceleration[k] + dt/3.0f*f[i].jerk[k]));
+			t[i].velocity[k] = f[i].velocity[k] + dt*(f[i].acceleration[k] + dt/2.0f*f[i].jerk[k]);
+		}
+	}
+}
+
+// Shortest power of two fraction of the sub-step that is no longer than dt.
+static inline int blockLevelFor(float dt, float h) {
+	int level = 0;
+	while (level < MAX_BLOCK_LEVEL && h / (1 << level) > dt)
+		level++;
+	return level;
+}
+
+// Bodies step by blockAccuracy times |a| / |j|.  Aarseth's criterion, which uses the higher derivatives implied by the
+// Hermite interpolant, drowns in rounding noise at single precision, so we don't use it.
+static inline float blockDtFor(nb_world_t *world, nb_pva_t *pva, float h) {
+	float jn = m3dGetVectorLength3(pva->jerk);
+	return (jn > 0.0f) ? world->blockAccuracy * m3dGetVectorLength3(pva->acceleration) / jn : h;
+}
+
+// Evaluate the active bodies at their predicted state, correct them, and choose their next step.
+static void blockCorrectTask(void *ctx, int task, int nTasks) {
+	blockTask_t *bt = (blockTask_t *)ctx;
+	nb_world_t *world = bt->world;
+	nb_pva_t *f = world->pva[world->current()];
+	nb_pva_t *t = world->pva[world->next()];
+	float h = BLOCK_TICKS * bt->tickDt;
+	int begin, end;
+	nb_taskRange(world->nActive, task, nTasks, begin, end);
+	for (int a = begin; a < end; a++) {
+		int i = world->activeBodies[a];
+		nb_body_t *b = &world->bodies[i];
+		calculateAccelerationAndJerk(world, world->next(), i, NULL);
+
+		float dt = (bt->tNext - b->blockTime) * bt->tickDt;
+		M3DVector3f v;
+		for (int k = 0; k < 3; k++) {
+			v[k] = f[i].velocity[k] + dt/2.0f*(f[i].acceleration[k] + t[i].acceleration[k]) + dt*dt/12.0f*(f[i].jerk[k] - t[i].jerk[k]);
+			f[i].position[k] = f[i].position[k] + dt/2.0f*(f[i].velocity[k] + v[k]) + dt*dt/12.0f*(f[i].acceleration[k] - t[i].acceleration[k]);
+		}
+		m3dCopyVector3(f[i].velocity, v);
+		m3dCopyVector3(f[i].acceleration, t[i].acceleration);
+		m3dCopyVector3(f[i].jerk, t[i].jerk);
+		b->blockTime = bt->tNext;
+
+		// Steps may shrink freely, but only grow by a factor of two, and only when that keeps the body on the block grid.
+		int level = blockLevelFor(blockDtFor(world, &f[i], h), h);
+		if (level < b->stepLevel) {
+			level = b->stepLevel - 1;
+			if (bt->tNext % (BLOCK_TICKS >> level) != 0)
+				level = b->stepLevel;
+		}
+		b->stepLevel = level;
+	}
+}
+
+// Every body is synchronised at the start of a sub-step, and the sub-step length changes between calls, so each body
+// picks its level afresh.
+static void blockStartTask(void *ctx, int task, int nTasks) {
+	blockTask_t *bt = (blockTask_t *)ctx;
+	nb_world_t *world = bt->world;
+	nb_pva_t *pva = world->pva[world->current()];
+	float h = BLOCK_TICKS * bt->tickDt;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		nb_body_t *b = &world->bodies[i];
+		b->blockTime = 0;
+		b->stepLevel = blockLevelFor(blockDtFor(world, &pva[i], h), h);
+	}
+}
+
+static void validateAccelerationsAndJerks(nb_world_t *world) {
+	if (!world->accelerationsValid || !world->jerksValid) {
+		stepTask_t st = { world, world->current(), 0, 0, 0.0f };
+		runTasks(world, accelerationAndJerkTask, &st);
+		world->nForceEvaluations += world->nBodies;
+		world->accelerationsValid = true;
+		world->jerksValid         = true;
+	}
+}
+
+typedef struct {
+	nb_world_t *world;
+	float      *longest;  // One per task.
+	float      *skip;
+} blockSpanTask_t;
+
+// Longest step any body wants, and shortest time for a body to move its own radius, over a range of bodies.
+static void blockSpanTask(void *ctx, int task, int nTasks) {
+	blockSpanTask_t *bs = (blockSpanTask_t *)ctx;
+	nb_world_t *world = bs->world;
+	nb_pva_t *pva = world->pva[world->current()];
+	float longest = 0.0f;
+	float skip = INFINITY;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		longest = fmaxf(longest, blockDtFor(world, &pva[i], INFINITY));
+		float v = m3dGetVectorLength3(pva[i].velocity);
+		if (v > 0.0f && world->bodies[i].radius < skip * v)
+			skip = world->bodies[i].radius / v;
+	}
+	bs->longest[task] = longest;
+	bs->skip[task] = skip;
+}
+
+// The block integrator picks its own sub-steps, ignoring nSteps, stepDt and adaptiveSteps.  A sub-step is as long as the
+// longest step any body wants, so quiet bodies are never held to a shorter one, and bodies that want less step by powers
+// of two within it.  Impacts are only found at the start of each sub-step, so no body may move further than its own
+// radius in one.  maxSteps bounds the count.
+static int chooseBlockSteps(nb_world_t *world, float dt) {
+	validateAccelerationsAndJerks(world);
+
+	int nTasks = taskCount(world);
+	float longest[NB_MAX_THREADS], skip[NB_MAX_THREADS];
+	blockSpanTask_t bs = { world, longest, skip };
+	runTasks(world, blockSpanTask, &bs);
+
+	float h = INFINITY;
+	float maxLongest = 0.0f;
+	for (int t = 0; t < nTasks; t++) {
+		maxLongest = fmaxf(maxLongest, longest[t]);
+		h = fminf(h, skip[t]);
+	}
+	h = fminf(h, maxLongest);
+
+	float steps = dt / h;
+	if (!(steps < world->maxSteps))  // Also catches NaN.
+		return world->maxSteps;
+	if (steps < 1.0f)
+		return 1;
+	return (int)ceilf(steps);
+}
+
+// Advance all bodies by h, only evaluating forces on the bodies whose steps end at each block time.
+static void integrateBlock(nb_world_t *world, float h) {
+	blockTask_t bt = { world, 0, h / BLOCK_TICKS };
+	world->potentialSlot = -1;  // Bodies are evaluated at different times, so the potentials would never all be current.
+	validateAccelerationsAndJerks(world);
+	runTasks(world, blockStartTask, &bt);
+
+	if (world->activeBodies == NULL)
+		world->activeBodies = (int *)malloc(world->nBodies * sizeof(int));
+
+	for (;;) {
+		// Once every body has reached the end of the sub-step, the earliest step end is past it.
+		int tNext = 2 * BLOCK_TICKS;
+		for (int i = 0; i < world->nBodies; i++) {
+			int end = world->bodies[i].blockTime + (BLOCK_TICKS >> world->bodies[i].stepLevel);
+			if (end < tNext)
+				tNext = end;
+		}
+		if (tNext > BLOCK_TICKS)
+			break;
+
+		world->nActive = 0;
+		for (int i = 0; i < world->nBodies; i++) {
+			if (world->bodies[i].blockTime + (BLOCK_TICKS >> world->bodies[i].stepLevel) == tNext)
+				world->activeBodies[world->nActive++] = i;
+		}
+
+		bt.tNext = tNext;
+		runTasks(world, blockPredictTask, &bt);
+		runTasks(world, blockCorrectTask, &bt);
+		world->nForceEvaluations += world->nActive;
+	}
+}
+
+static inline void addPair(nb_pairList_t *list, int i, int j) {
+	if (list->nPairs == list->maxPairs) {
+		list->maxPairs = (list->maxPairs == 0) ? 64 : list->maxPairs * 2;
+		list->pairs = (int *)realloc(list->pairs, list->maxPairs * 2 * sizeof(int));
+	}
+	list->pairs[2 * list->nPairs]     = i;
+	list->pairs[2 * list->nPairs + 1] = j;
+	list->nPairs++;
+}
+
+static nb_pairList_t *getPairLists(nb_world_t *world, int nTasks) {
+	if (world->nPairLists < nTasks) {
+		world->pairLists = (nb_pairList_t *)realloc(world->pairLists, nTasks * sizeof(nb_pairList_t));
+		memset(&world->pairLists[world->nPairLists], 0, (nTasks - world->nPairLists) * sizeof(nb_pairList_t));
+		world->nPairLists = nTasks;
+	}
+	return world->pairLists;
+}
+
+static inline bool bodiesOverlap(nb_world_t *world, int slot, int i, int j) {
+	nb_pva_t *pva_i = world->getPVA(slot, i);
+	nb_pva_t *pva_j = world->getPVA(slot, j);
+	
+	M3DVector3f sep;
+	m3dSubtractVectors3(sep, pva_i->position, pva_j->position);
+	float d2 =  m3dGetVectorLengthSquared3(sep);
+	float dmin = (world->bodies[i].radius + world->bodies[j].radius);
+	
+	// Small fudge factor so bodies don't get too close.  It looks funny.
+	return d2/world->bounceFudgeFactor <= dmin * dmin;
+}
+
+// Find every pair (i, j > i) whose bodies overlap, in order of i then j.
+// This only looks at positions, which handleImpacts never changes, so the bands of rows can be searched in parallel.
+static void overlapTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	nb_pairList_t *list = &world->pairLists[task];
+	list->nPairs = 0;
+
+	int rowEnd = pairRowSplit(world->nBodies, nTasks, task + 1);
+	for (int i = pairRowSplit(world->nBodies, nTasks, task); i < rowEnd; i++) {
 		for (int j = i+1; j < world->nBodies; j++) {
-			nb_pva_t *pva_j = &world->bodies[j].pva[slot];
-			
-			M3DVector3f sep;
-			m3dSubtractVectors3(sep, pva_i->position, pva_j->position);
-			float d2 =  m3dGetVectorLengthSquared3(sep);
-			float dmin = (world->bodies[i].radius + world->bodies[j].radius);
-			
-			// Small fudge factor so bodies don't get too close.  It looks funny.
-			if (d2/world->bounceFudgeFactor > dmin * dmin)
-				continue;
+			if (bodiesOverlap(world, st->slot, i, j))
+				addPair(list, i, j);
+		}
+	}
+}
 
-			// Bodies are too close.  Reverse the component of their velocity parralel to the vector joining their centers. 
-			M3DVector3f v_com;
-			m3dLoadVector3(v_com,  0.0f, 0.0f, 0.0f);
-			weightedAccumulate(v_com,  pva_i->velocity, world->bodies[i].mass);
-			weightedAccumulate(v_com,  pva_j->velocity, world->bodies[j].mass);
-			m3dScaleVector3(v_com, 1.0f/(world->bodies[i].mass + world->bodies[j].mass));
-			
-			M3DVector3f vrel_i, vrel_j;
-			m3dSubtractVectors3(vrel_i, pva_i->velocity, v_com);
-			m3dSubtractVectors3(vrel_j, pva_j->velocity, v_com);
-			m3dNormalizeVector3(sep);
-			
-			//calculate normal component of relative velocity.
-			float vnorm_i = m3dDotProduct3(sep, vrel_i);
-			float vnorm_j = m3dDotProduct3(sep, vrel_j);
+// Same pairs as overlapTask, only testing bodies in neighbouring cells of the grid.
+// A row's pairs are found in bucket order, so they are sorted by j afterwards.  There are rarely more than a few.
+static void gridOverlapTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	nb_grid_t *grid = world->grid;
+	nb_pairList_t *list = &world->pairLists[task];
+	list->nPairs = 0;
 
-			// Ensure bodies are actually moving towards each other.
-			if (m3dDotProduct3(sep, vrel_i) > 0)
-				continue;
-			
-			weightedAccumulate(pva_i->velocity, sep, -2.0f*vnorm_i);
-			weightedAccumulate(pva_j->velocity, sep, -2.0f*vnorm_j);
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		int buckets[27];
+		int nBuckets = nb_gridNeighbours(grid, i, buckets);
+		int rowStart = list->nPairs;
+
+		for (int b = 0; b < nBuckets; b++) {
+			for (int k = grid->bucketStart[buckets[b]]; k < grid->bucketStart[buckets[b] + 1]; k++) {
+				int j = grid->bodies[k];
+				if (j > i && bodiesOverlap(world, st->slot, i, j))
+					addPair(list, i, j);
+			}
 		}
 
-		// Also make sure the body doesn't escape to infinity.
+		for (int p = rowStart + 1; p < list->nPairs; p++) {
+			int j = list->pairs[2 * p + 1];
+			int q = p;
+			for (; q > rowStart && list->pairs[2 * q - 1] > j; q--)
+				list->pairs[2 * q + 1] = list->pairs[2 * q - 1];
+			list->pairs[2 * q + 1] = j;
+		}
+	}
+}
+
+// Filter a share of the sweep and prune candidates, which are already in order of i then j.
+static void sweepOverlapTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	nb_sweep_t *sweep = world->sweep;
+	nb_pairList_t *list = &world->pairLists[task];
+	list->nPairs = 0;
+
+	int begin, end;
+	nb_taskRange(sweep->nCandidates, task, nTasks, begin, end);
+	for (int p = begin; p < end; p++) {
+		int i = sweep->candidates[2 * p];
+		int j = sweep->candidates[2 * p + 1];
+		if (bodiesOverlap(world, st->slot, i, j))
+			addPair(list, i, j);
+	}
+}
+
+// Fill the per task pair lists with every overlapping pair, in order of i then j, using the world's broad phase.
+static void findOverlaps(nb_world_t *world, stepTask_t *st) {
+	// Bodies can touch when they are less than sqrt(bounceFudgeFactor) times the sum of their radii apart.
+	float scale = sqrtf(world->bounceFudgeFactor) * 1.001f;
+
+	if (world->broadPhase == NB_BROADPHASE_SWEEP) {
+		nb_sweepCandidates(world, st->slot, scale);
+		runTasks(world, sweepOverlapTask, st);
+		return;
+	}
+
+	if (world->broadPhase == NB_BROADPHASE_GRID) {
+		float maxRadius = 0.0f;
+		for (int i = 0; i < world->nBodies; i++) {
+			if (world->bodies[i].radius > maxRadius)
+				maxRadius = world->bodies[i].radius;
+		}
+		// Cells must be at least as wide as the largest distance at which two bodies can touch.
+		if (maxRadius > 0.0f) {
+			nb_buildGrid(world, world->pva[st->slot][0].position, sizeof(nb_pva_t) / sizeof(float), 2.0f * maxRadius * scale);
+			runTasks(world, gridOverlapTask, st);
+			return;
+		}
+	}
+
+	runTasks(world, overlapTask, st);
+}
+
+static void bounceOffEdgeTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	st->counts[task] = 0;
+	for (int i = begin; i < end; i++) {
+		nb_pva_t *pva_i = world->getPVA(st->slot, i);
+
+		// Make sure the body doesn't escape to infinity.
 		float r2 = m3dGetVectorLengthSquared3(pva_i->position);
 		
 		if (r2 < world->radius * world->radius)
@@ -118,49 +847,793 @@ static inline void handleImpacts(nb_world_t *world, int slot) {
 		if (m3dDotProduct3(pva_i->position, pva_i->velocity) < 0)
 			continue;
 			
-		// Again reverse outbound component of velocity
+		// Reverse outbound component of velocity
 		M3DVector3f n;
 		m3dCopyVector3(n, pva_i->position);
 		m3dNormalizeVector3(n);
 		float vnorm = m3dDotProduct3(n, pva_i->velocity);
 
 		weightedAccumulate(pva_i->velocity, n, -2.0f*vnorm);
+		st->counts[task]++;
 	}
 }
 
-#define STEPS 100
-void nb_integrate(nb_world_t *world, float dt) {
-	for (int i = 0; i < STEPS; i++) {
+// Bodies are too close.  Reverse the component of their velocity parralel to sep, the vector joining their centers,
+// unless they are already moving apart.  Returns whether they bounced.
+static inline bool bounceBodies(nb_world_t *world, nb_pva_t *pva_i, nb_pva_t *pva_j, int i, int j, M3DVector3f sep) {
+	M3DVector3f v_com;
+	m3dLoadVector3(v_com,  0.0f, 0.0f, 0.0f);
+	weightedAccumulate(v_com,  pva_i->velocity, world->bodies[i].mass);
+	weightedAccumulate(v_com,  pva_j->velocity, world->bodies[j].mass);
+	m3dScaleVector3(v_com, 1.0f/(world->bodies[i].mass + world->bodies[j].mass));
+	
+	M3DVector3f vrel_i, vrel_j;
+	m3dSubtractVectors3(vrel_i, pva_i->velocity, v_com);
+	m3dSubtractVectors3(vrel_j, pva_j->velocity, v_com);
+	m3dNormalizeVector3(sep);
+	
+	//calculate normal component of relative velocity.
+	float vnorm_i = m3dDotProduct3(sep, vrel_i);
+	float vnorm_j = m3dDotProduct3(sep, vrel_j);
+
+	// Ensure bodies are actually moving towards each other.
+	if (m3dDotProduct3(sep, vrel_i) > 0)
+		return false;
+	
+	weightedAccumulate(pva_i->velocity, sep, -2.0f*vnorm_i);
+	weightedAccumulate(pva_j->velocity, sep, -2.0f*vnorm_j);
+	return true;
+}
+
+// Overlapping pairs are found in parallel, then bounced one after the other in order of i then j, as a pair's
+// bounce depends on the velocities left by earlier bounces.  Bouncing off the edge of the world only depends on a body's own
+// state, and every pair involving a body has been handled by then, so it is done in parallel last.
+// Returns the number of bounces.
+static inline int handleImpacts(nb_world_t *world, int slot) {
+	int nTasks = taskCount(world);
+	int counts[NB_MAX_THREADS];
+	stepTask_t st = { world, slot, 0, 0, 0.0f, counts };
+	nb_pairList_t *lists = getPairLists(world, nTasks);
+
+	findOverlaps(world, &st);
+
+	int bounces = 0;
+	for (int t = 0; t < nTasks; t++) {
+		for (int p = 0; p < lists[t].nPairs; p++) {
+			int i = lists[t].pairs[2 * p];
+			int j = lists[t].pairs[2 * p + 1];
+			M3DVector3f sep;
+			m3dSubtractVectors3(sep, world->getPVA(slot, i)->position, world->getPVA(slot, j)->position);
+			if (bounceBodies(world, world->getPVA(slot, i), world->getPVA(slot, j), i, j, sep))
+				bounces++;
+		}
+	}
+
+	runTasks(world, bounceOffEdgeTask, &st);
+	for (int t = 0; t < nTasks; t++)
+		bounces += counts[t];
+	return bounces;
+}
+
+// Continuous collision detection.  Over a step from slot `from` to slot `to`, each body is taken to move in a straight line.
+// The step is cut short at the first moment a pair that was apart comes within contact distance, the pair bounces there,
+// and the rest of the step is integrated afresh from the bounced state, until a step has no new contacts.  That catches
+// pairs which pass through each other within one step, without the pair picking up the energy of the deeper part of the
+// potential the uncut step took it through.
+
+typedef struct {
+	float s;     // Fraction of the step at which the pair touches.
+	int   i;
+	int   j;
+} impact_t;
+
+// Bounding sphere of each body's path over the step, including the contact distance.
+static void sweptBoundsTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	float scale = sqrtf(world->bounceFudgeFactor) * 1.001f;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		float *x0 = world->getPVA(st->from, i)->position;
+		float *x1 = world->getPVA(st->to, i)->position;
+		M3DVector3f d;
+		m3dSubtractVectors3(d, x1, x0);
+		for (int k = 0; k < 3; k++)
+			world->sweptCenters[i][k] = (x0[k] + x1[k]) / 2.0f;
+		world->sweptRadii[i] = world->bodies[i].radius * scale + m3dGetVectorLength3(d) / 2.0f;
+	}
+}
+
+static inline bool sweptOverlap(nb_world_t *world, int i, int j) {
+	M3DVector3f d;
+	m3dSubtractVectors3(d, world->sweptCenters[i], world->sweptCenters[j]);
+	float r = world->sweptRadii[i] + world->sweptRadii[j];
+	return m3dGetVectorLengthSquared3(d) <= r * r;
+}
+
+// Pairs whose swept spheres overlap, from the grid unless the world tests every pair.
+static void sweptPairsTask(void *ctx, int task, int nTasks) {
+	stepTask_t *st = (stepTask_t *)ctx;
+	nb_world_t *world = st->world;
+	nb_pairList_t *list = &world->pairLists[task];
+	list->nPairs = 0;
+
+	if (world->broadPhase == NB_BROADPHASE_NONE) {
+		int rowEnd = pairRowSplit(world->nBodies, nTasks, task + 1);
+		for (int i = pairRowSplit(world->nBodies, nTasks, task); i < rowEnd; i++) {
+			for (int j = i + 1; j < world->nBodies; j++) {
+				if (sweptOverlap(world, i, j))
+					addPair(list, i, j);
+			}
+		}
+		return;
+	}
+
+	nb_grid_t *grid = world->grid;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		int buckets[27];
+		int nBuckets = nb_gridNeighbours(grid, i, buckets);
+		for (int b = 0; b < nBuckets; b++) {
+			for (int k = grid->bucketStart[buckets[b]]; k < grid->bucketStart[buckets[b] + 1]; k++) {
+				int j = grid->bodies[k];
+				if (j > i && sweptOverlap(world, i, j))
+					addPair(list, i, j);
+			}
+		}
+	}
+}
+
+// Fraction of the step, in [0, 1], at which bodies i and j first come within contact distance.
+// False if they were already in contact at the start, which handleImpacts deals with, or never touch.
+static bool timeOfImpact(nb_world_t *world, int from, int to, int i, int j, float &s) {
+	M3DVector3f d0, d1, dd;
+	m3dSubtractVectors3(d0, world->getPVA(from, i)->position, world->getPVA(from, j)->position);
+	m3dSubtractVectors3(d1, world->getPVA(to, i)->position,   world->getPVA(to, j)->position);
+	m3dSubtractVectors3(dd, d1, d0);
+
+	float dmin = world->bodies[i].radius + world->bodies[j].radius;
+	float a = m3dGetVectorLengthSquared3(dd);
+	float b = 2.0f * m3dDotProduct3(d0, dd);
+	float c = m3dGetVectorLengthSquared3(d0) - dmin * dmin * world->bounceFudgeFactor;
+	if (c <= 0.0f || a == 0.0f || b >= 0.0f)
+		return false;
+
+	float disc = b * b - 4.0f * a * c;
+	if (disc < 0.0f)
+		return false;
+
+	s = (-b - sqrtf(disc)) / (2.0f * a);
+	return s <= 1.0f;
+}
+
+// The first pair to come into contact over a step, in order of s, then i, then j.  False if none does.
+static bool firstImpact(nb_world_t *world, int from, int to, impact_t *first) {
+	if (world->sweptCenters == NULL) {
+		world->sweptCenters = (M3DVector3f *)malloc(world->nBodies * sizeof(M3DVector3f));
+		world->sweptRadii   = (float *)malloc(world->nBodies * sizeof(float));
+	}
+
+	int nTasks = taskCount(world);
+	stepTask_t st = { world, to, from, to, 0.0f };
+	nb_pairList_t *lists = getPairLists(world, nTasks);
+	runTasks(world, sweptBoundsTask, &st);
+
+	if (world->broadPhase != NB_BROADPHASE_NONE) {
+		float maxRadius = 0.0f;
+		for (int i = 0; i < world->nBodies; i++) {
+			if (world->sweptRadii[i] > maxRadius)
+				maxRadius = world->sweptRadii[i];
+		}
+		nb_buildGrid(world, world->sweptCenters[0], 3, 2.0f * maxRadius);
+	}
+	runTasks(world, sweptPairsTask, &st);
+
+	bool found = false;
+	for (int t = 0; t < nTasks; t++) {
+		for (int p = 0; p < lists[t].nPairs; p++) {
+			impact_t im;
+			im.i = lists[t].pairs[2 * p];
+			im.j = lists[t].pairs[2 * p + 1];
+			if (!timeOfImpact(world, from, to, im.i, im.j, im.s))
+				continue;
+			if (!found || im.s < first->s) {  // The lists are in order of i then j, so ties keep the first.
+				*first = im;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+// Bounce the pair of an impact in the current slot, which the step has just brought them to.  The integrator's path
+// needn't be the straight line the time of impact assumed, so they may not quite touch, but they bounce anyway.  Pairs
+// that do touch by then bounce too.  Returns the number of bounces.
+static int bounceImpact(nb_world_t *world, impact_t *im) {
+	int slot = world->current();
+	M3DVector3f sep;
+	m3dSubtractVectors3(sep, world->getPVA(slot, im->i)->position, world->getPVA(slot, im->j)->position);
+	int bounces = bounceBodies(world, world->getPVA(slot, im->i), world->getPVA(slot, im->j), im->i, im->j, sep) ? 1 : 0;
+	return bounces + handleImpacts(world, slot);
+}
+
+typedef struct {
+	nb_world_t *world;
+	int         slot;
+	nb_grid_t  *grid;  // Or NULL if no body has a size.
+	float      *tau;   // Each of these has one per task.
+	float      *gap;
+	float      *skip;
+} crossingTask_t;
+
+// Shortest times, over a range of bodies, in O(N):
+//  tau:  for a body's velocity to change by about its own size, or, if it is slower than sqrt(radius * |a|), for its
+//        acceleration to move it by about its own radius.  That is (|v| + sqrt(radius * |a|)) / |a|, which shrinks as
+//        bodies fall together.
+//  gap:  for a body to close the gap to one in a neighbouring cell of the grid, at the speed they are approaching along
+//        the line between them.  Pairs moving apart, or passing, don't count.  Gaps are floored at a tenth of the sum of
+//        the radii, so touching bodies still give a finite time.
+//  skip: for a body to move by its own radius.
+static void crossingTimeTask(void *ctx, int task, int nTasks) {
+	crossingTask_t *ct = (crossingTask_t *)ctx;
+	nb_world_t *world = ct->world;
+	nb_pva_t *pva = world->pva[ct->slot];
+	nb_grid_t *grid = ct->grid;
+	float tau = INFINITY;
+	float gapTau = INFINITY;
+
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		float a = m3dGetVectorLength3(pva[i].acceleration);
+		if (a > 0.0f) {
+			float t = (m3dGetVectorLength3(pva[i].velocity) + sqrtf(world->bodies[i].radius * a)) / a;
+			if (t < tau)
+				tau = t;
+		}
+		if (grid == NULL)
+			continue;
+
+		int buckets[27];
+		int nBuckets = nb_gridNeighbours(grid, i, buckets);
+		for (int b = 0; b < nBuckets; b++) {
+			for (int k = grid->bucketStart[buckets[b]]; k < grid->bucketStart[buckets[b] + 1]; k++) {
+				int j = grid->bodies[k];
+				if (j <= i)
+					continue;
+
+				M3DVector3f dp, dv;
+				m3dSubtractVectors3(dp, pva[i].position, pva[j].position);
+				m3dSubtractVectors3(dv, pva[i].velocity, pva[j].velocity);
+				float d = m3dGetVectorLength3(dp);
+				float closing = -m3dDotProduct3(dp, dv) / d;
+				if (!(closing > 0.0f))  // Also skips coincident bodies.
+					continue;
+
+				float dmin = world->bodies[i].radius + world->bodies[j].radius;
+				float gap  = d - dmin;
+				if (gap < 0.1f * dmin)
+					gap = 0.1f * dmin;
+				if (gap < gapTau * closing)
+					gapTau = gap / closing;
+			}
+		}
+	}
+	ct->tau[task] = tau;
+	ct->gap[task] = gapTau;
+
+	float skip = INFINITY;
+	for (int i = begin; i < end; i++) {
+		float v = m3dGetVectorLength3(pva[i].velocity);
+		if (v > 0.0f && world->bodies[i].radius < skip * v)
+			skip = world->bodies[i].radius / v;
+	}
+	ct->skip[task] = skip;
+}
+
+// Number of sub-steps nb_integrate should split dt into.
+static int chooseSteps(nb_world_t *world, float dt) {
+	if (world->integrator == NB_INTEGRATOR_BLOCK)
+		return chooseBlockSteps(world, dt);
+
+	if (world->adaptiveSteps) {
+		// The accelerations from the last force pass are close enough, even if the corrector has moved the bodies since.
+		// Only a world that has never been stepped needs them calculating.
+		if (!world->accelerationsValid && world->nForceEvaluations == 0) {
+			calculateAccelerations(world, world->current());
+			world->accelerationsValid = true;
+		}
+
+		// Cells twice the widest contact distance, so neighbours are the bodies within a contact distance or two.
+		float maxRadius = 0.0f;
+		for (int i = 0; i < world->nBodies; i++) {
+			if (world->bodies[i].radius > maxRadius)
+				maxRadius = world->bodies[i].radius;
+		}
+		nb_grid_t *grid = NULL;
+		if (maxRadius > 0.0f) {
+			nb_buildGrid(world, world->pva[world->current()][0].position, sizeof(nb_pva_t) / sizeof(float), 4.0f * maxRadius);
+			grid = world->grid;
+		}
+
+		int nTasks = taskCount(world);
+		float tau[NB_MAX_THREADS], gap[NB_MAX_THREADS], skip[NB_MAX_THREADS];
+		crossingTask_t ct = { world, world->current(), grid, tau, gap, skip };
+		runTasks(world, crossingTimeTask, &ct);
+
+		float minTau  = INFINITY;
+		float minGap  = INFINITY;
+		float minSkip = INFINITY;
+		for (int t = 0; t < nTasks; t++) {
+			minTau  = fminf(minTau,  tau[t]);
+			minGap  = fminf(minGap,  gap[t]);
+			minSkip = fminf(minSkip, skip[t]);
+		}
+
+		// Approaching pairs ask for at most nSteps, so a near miss costs no more than fixed steps would.  No body may move
+		// further than its own radius in a sub-step, so none can pass through another unseen.  maxSteps bounds the rest.
+		float gapSteps = fminf(dt / (world->stepAccuracy * minGap), (float)world->nSteps);
+		float steps = fmaxf(fmaxf(dt / (world->stepAccuracy * minTau), gapSteps), dt / minSkip);
+		if (!(steps < world->maxSteps))  // Also catches NaN.
+			return world->maxSteps;
+		if (steps < world->minSteps)
+			return world->minSteps;
+		return (int)ceilf(steps);
+	}
+
+	if (world->stepDt > 0.0f) {
+		int steps = (int)ceilf(dt / world->stepDt);
+		return (steps < 1) ? 1 : steps;
+	}
+
+	return world->nSteps;
+}
+
+// Dormand-Prince 5(4).  Stage s is evaluated at y0 + h * sum(rkA[s][j] * k[j]), where k is the derivative of (position, velocity).
+// The last stage is the fifth order solution itself, so its acceleration starts the next step.  rkE is the difference
+// between the fifth and fourth order weights, which gives the error estimate.
+#define RK_STAGES 7
+
+static const float rkA[RK_STAGES][RK_STAGES - 1] = {
+	{ 0.0f },
+	{ 1.0f/5.0f },
+	{ 3.0f/40.0f, 9.0f/40.0f },
+	{ 44.0f/45.0f, -56.0f/15.0f, 32.0f/9.0f },
+	{ 19372.0f/6561.0f, -25360.0f/2187.0f, 64448.0f/6561.0f, -212.0f/729.0f },
+	{ 9017.0f/3168.0f, -355.0f/33.0f, 46732.0f/5247.0f, 49.0f/176.0f, -5103.0f/18656.0f },
+	{ 35.0f/384.0f, 0.0f, 500.0f/1113.0f, 125.0f/192.0f, -2187.0f/6784.0f, 11.0f/84.0f }
+};
+
+static const float rkE[RK_STAGES] = {
+	71.0f/57600.0f, 0.0f, -71.0f/16695.0f, 71.0f/1920.0f, -17253.0f/339200.0f, 22.0f/525.0f, -1.0f/40.0f
+};
+
+typedef struct {
+	nb_world_t *world;
+	int         stage;
+	float       h;
+	double     *err;  // One per task.
+} rkTask_t;
+
+// The derivative of stage s of body i is rkK[2 * (s * nBodies + i)] for the position, and the next vector for the velocity.
+static inline float *rkK(nb_world_t *world, int stage, int i, int k) {
+	return world->rkK[2 * (stage * world->nBodies + i) + k];
+}
+
+// Save the derivatives of the previous stage, which was evaluated in the current slot for stage 1 and the next slot after that,
+// then set up this stage's state in the next slot.
+static void rkStageTask(void *ctx, int task, int nTasks) {
+	rkTask_t *rt = (rkTask_t *)ctx;
+	nb_world_t *world = rt->world;
+	int s = rt->stage;
+	nb_pva_t *y0 = world->pva[world->current()];
+	nb_pva_t *p  = world->pva[(s == 1) ? world->current() : world->next()];
+	nb_pva_t *t  = world->pva[world->next()];
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		m3dCopyVector3(rkK(world, s - 1, i, 0), p[i].velocity);
+		m3dCopyVector3(rkK(world, s - 1, i, 1), p[i].acceleration);
+
+		M3DVector3f dx, dv;
+		m3dLoadVector3(dx, 0.0f, 0.0f, 0.0f);
+		m3dLoadVector3(dv, 0.0f, 0.0f, 0.0f);
+		for (int j = 0; j < s; j++) {
+			weightedAccumulate(dx, rkK(world, j, i, 0), rkA[s][j]);
+			weightedAccumulate(dv, rkK(world, j, i, 1), rkA[s][j]);
+		}
+		for (int k = 0; k < 3; k++) {
+			t[i].position[k] = y0[i].position[k] + rt->h * dx[k];
+			t[i].velocity[k] = y0[i].velocity[k] + rt->h * dv[k];
+		}
+	}
+}
+
+// Save the derivatives of the last stage and sum the squares of the scaled error estimates.
+// Each component is scaled by rkTolerance * (1 + its larger magnitude at the start and end of the step).
+static void rkErrorTask(void *ctx, int task, int nTasks) {
+	rkTask_t *rt = (rkTask_t *)ctx;
+	nb_world_t *world = rt->world;
+	nb_pva_t *y0 = world->pva[world->current()];
+	nb_pva_t *y1 = world->pva[world->next()];
+	double err2 = 0.0;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		m3dCopyVector3(rkK(world, RK_STAGES - 1, i, 0), y1[i].velocity);
+		m3dCopyVector3(rkK(world, RK_STAGES - 1, i, 1), y1[i].acceleration);
+
+		for (int k = 0; k < 3; k++) {
+			float ex = 0.0f, ev = 0.0f;
+			for (int j = 0; j < RK_STAGES; j++) {
+				ex += rkE[j] * rkK(world, j, i, 0)[k];
+				ev += rkE[j] * rkK(world, j, i, 1)[k];
+			}
+			double sx = world->rkTolerance * (1.0f + fmaxf(fabsf(y0[i].position[k]), fabsf(y1[i].position[k])));
+			double sv = world->rkTolerance * (1.0f + fmaxf(fabsf(y0[i].velocity[k]), fabsf(y1[i].velocity[k])));
+			err2 += (rt->h * ex / sx) * (rt->h * ex / sx) + (rt->h * ev / sv) * (rt->h * ev / sv);
+		}
+	}
+	rt->err[task] = err2;
+}
+
+// Try one step of length h from the current slot into the next.  Returns the RMS scaled error, which is at most 1 if the step
+// meets the tolerance.
+static float dormandPrinceStep(nb_world_t *world, float h) {
+	int nTasks = taskCount(world);
+	double err[NB_MAX_THREADS];
+	rkTask_t rt = { world, 0, h, err };
+
+	if (!world->accelerationsValid) {
+		calculateAccelerations(world, world->current());
+		world->accelerationsValid = true;
+	}
+	for (rt.stage = 1; rt.stage < RK_STAGES; rt.stage++) {
+		runTasks(world, rkStageTask, &rt);
+		calculateAccelerations(world, world->next());
+	}
+	runTasks(world, rkErrorTask, &rt);
+
+	double err2 = 0.0;
+	for (int t = 0; t < nTasks; t++)
+		err2 += err[t];
+	return (world->nBodies > 0) ? sqrt(err2 / (6 * world->nBodies)) : 0.0f;
+}
+
+// Advance by dt in as many steps as it takes to keep each step's error estimate within rkTolerance.
+// The step length carries over between calls.  Steps shorter than dt / maxSteps are accepted regardless, so a close
+// encounter can't stall the simulation.  Returns the number of steps taken.
+static int integrateDormandPrince(nb_world_t *world, float dt) {
+	if (world->rkK == NULL)
+		world->rkK = (M3DVector3f *)malloc((size_t)2 * RK_STAGES * world->nBodies * sizeof(M3DVector3f));
+
+	float minH = dt / world->maxSteps;
+	float h = (world->rkDt > 0.0f) ? world->rkDt : dt / world->nSteps;
+	float remaining = dt;
+	int steps = 0;
+
+	while (remaining > 0.0f) {
+		// Bounces only change velocities, and the stages read velocities afresh, so the accelerations stay valid.
 		handleImpacts(world, world->current());
-		integrateEuler(world, dt/100, world->current(), world->next());
-		reintegrateTrapezoid(world, dt/100, world->current(), world->next());
-		world->inc(dt/100);
+
+		bool last = (h >= remaining);
+		float step = last ? remaining : h;
+		float err;
+		for (;;) {
+			err = dormandPrinceStep(world, step);
+			if (err <= 1.0f || step <= minH)
+				break;
+
+			// Rejected.  Shrink to what should just meet the tolerance, with a safety factor, but no more than five times.
+			step *= fmaxf(0.9f * powf(err, -0.2f), 0.2f);
+			if (step < minH)
+				step = minH;
+			last = false;
+			world->rkRejected++;
+		}
+
+		// If a pair comes into contact during the step, only go as far as the moment they touch.  It is shorter than a step
+		// that met the tolerance, so it is accepted.  Steps shorter than minH go the whole way, and leave it to handleImpacts.
+		float accepted = step;
+		bool truncated = last;  // Cut to what was left of dt, rather than to meet the tolerance.
+		impact_t im;
+		bool impact = world->continuousImpacts && step > minH && firstImpact(world, world->current(), world->next(), &im) &&
+		              im.s < 1.0f;
+		if (impact) {
+			step = fmaxf(im.s * step, minH);
+			dormandPrinceStep(world, step);
+			last = false;
+		}
+
+		// The last stage's acceleration is the new state's, so it stays valid.  Bounces don't move the bodies.
+		world->inc(step);
+		world->jerksValid = false;
+		if (impact)
+			bounceImpact(world, &im);
+		if (world->trajectory != NULL)
+			nb_recordTrajectory(world->trajectory, world);
+		remaining = last ? 0.0f : remaining - step;
+		steps++;
+
+		// A step cut short by an impact says nothing about the error, so grow from the one that met the tolerance.  One cut
+		// short by the end of dt met it at a smaller length than h would have, so don't let it shrink the next call's steps.
+		float grow = (err > 0.0f) ? 0.9f * powf(err, -0.2f) : 5.0f;
+		h = (truncated ? fmaxf(accepted, h) : accepted) * fminf(fmaxf(grow, 0.2f), 5.0f);
 	}
+	world->rkDt = h;
+	return steps;
 }
 
-void nb_getSummaryValues(float &mtot, M3DVector3f com, M3DVector3f vtot, float &etot, nb_world_t* world) {
-	mtot = 0.0f;
-	m3dLoadVector3(com,  0.0f, 0.0f, 0.0f);
-	m3dLoadVector3(vtot, 0.0f, 0.0f, 0.0f);
-	etot = 0.0f;
-	
-	for (int i = 0; i < world->nBodies; i++) {
-		mtot += world->bodies[i].mass;
+// One step of the fixed step integrators from the current slot into the next.  Afterwards the current slot's accelerations
+// are valid, and so are its jerks for NB_INTEGRATOR_HERMITE, while the flags describe the next slot.
+static void integrateStep(nb_world_t *world, float h) {
+	switch (world->integrator) {
+	case NB_INTEGRATOR_HERMITE:
+		integrateHermite(world, h, world->current(), world->next());
+		break;
+	case NB_INTEGRATOR_LEAPFROG:
+		integrateLeapfrog(world, h, world->current(), world->next());
+		break;
+	default:
+		integrateEuler(world, h, world->current(), world->next());
+		reintegrateTrapezoid(world, h, world->current(), world->next());
+		world->accelerationsValid = false;  // They were calculated before the trapezoid moved the bodies.
+		world->jerksValid         = false;
+		break;
+	}
+}
 
-		weightedAccumulate(com,  world->getCurrentPVA(i)->position, world->bodies[i].mass);
-		weightedAccumulate(vtot, world->getCurrentPVA(i)->velocity, world->bodies[i].mass);
-		
-		etot += 0.5f * world->bodies[i].mass * m3dGetVectorLengthSquared3(world->getCurrentPVA(i)->velocity);
+// A step that finds this many contacts in turn takes the rest of itself whole, and leaves any later ones to handleImpacts.
+#define MAX_IMPACT_PASSES 16
+
+// Step by h and make the result current.  With continuousImpacts, a step in which a pair comes into contact is taken again,
+// only as far as the moment they touch, and the rest of it is taken from there once they have bounced.
+static void integrateSubStep(nb_world_t *world, float h) {
+	float remaining = h;
+	for (int pass = 0; ; pass++) {
+		bool jerksValid = world->jerksValid;
+		integrateStep(world, remaining);
+
+		impact_t im;
+		if (!world->continuousImpacts || pass == MAX_IMPACT_PASSES ||
+		    !firstImpact(world, world->current(), world->next(), &im) || im.s >= 1.0f) {
+			world->inc(remaining);
+			return;
+		}
+
+		world->accelerationsValid = true;
+		world->jerksValid         = jerksValid || world->integrator == NB_INTEGRATOR_HERMITE;
+		float step = im.s * remaining;
+		integrateStep(world, step);
+		world->inc(step);
+		remaining -= step;
+
+		// Bounces only change velocities, so they don't invalidate the accelerations.  They do invalidate the jerks.
+		if (bounceImpact(world, &im) > 0)
+			world->jerksValid = false;
+	}
+}
+
+void nb_integrate(nb_world_t *world, float dt) {
+	if (world->integrator == NB_INTEGRATOR_DOPRI) {
+		world->stepsTaken = integrateDormandPrince(world, dt);
+		return;
+	}
+
+	int steps = chooseSteps(world, dt);
+	float h = dt / steps;
+	for (int i = 0; i < steps; i++) {
+		// Bounces only change velocities, so they don't invalidate the accelerations.  They do invalidate the jerks.
+		if (handleImpacts(world, world->current()) > 0)
+			world->jerksValid = false;
+
+		if (world->integrator == NB_INTEGRATOR_BLOCK) {
+			integrateBlock(world, h);
+			world->t += h;  // The bodies' state stays in the current slot.
+		}
+		else {
+			integrateSubStep(world, h);
+		}
+		if (world->trajectory != NULL)
+			nb_recordTrajectory(world->trajectory, world);
+	}
+	world->stepsTaken = steps;
+}
+
+typedef struct {
+	nb_world_t *world;
+	double     *err2;  // One per task.
+} forceErrorTask_t;
+
+static void forceErrorTask(void *ctx, int task, int nTasks) {
+	forceErrorTask_t *ft = (forceErrorTask_t *)ctx;
+	nb_world_t *world = ft->world;
+	double err2 = 0.0;
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		M3DVector3f exact, approx, diff;
+		float *pos = world->getCurrentPVA(i)->position;
+		directForceFieldAt(exact, NULL, pos, world, world->current(), i);
+		calculateForceFieldAt(approx, NULL, pos, world, world->current(), i);
+		m3dSubtractVectors3(diff, approx, exact);
+
+		float a2 = m3dGetVectorLengthSquared3(exact);
+		if (a2 > 0.0f)
+			err2 += m3dGetVectorLengthSquared3(diff) / a2;
+	}
+	ft->err2[task] = err2;
+}
+
+// RMS relative error of the accelerations of the current slot, as calculated by the world's force mode, against direct summation.
+// Split over the world's threads, as the tree or packed arrays are only read once built.
+float nb_getForceError(nb_world_t *world) {
+	prepareForceField(world, world->current());
+
+	int nTasks = taskCount(world);
+	forceErrorTask_t ft = { world, (double *)malloc(nTasks * sizeof(double)) };
+	runTasks(world, forceErrorTask, &ft);
+
+	double err2 = 0.0;
+	for (int task = 0; task < nTasks; task++)
+		err2 += ft.err2[task];
+	free(ft.err2);
+
+	return (world->nBodies > 0) ? sqrt(err2 / world->nBodies) : 0.0f;
+}
+
+// Kahan summation.  Each task keeps one of these per quantity, so sums over millions of bodies keep their low bits.
+typedef struct {
+	double sum;
+	double c;
+} kahan_t;
+
+static inline void kahanAdd(kahan_t *k, double x) {
+	double y = x - k->c;
+	double t = k->sum + y;
+	k->c = (t - k->sum) - y;
+	k->sum = t;
+}
+
+enum { DIAG_MASS, DIAG_COM, DIAG_MOMENTUM = DIAG_COM + 3, DIAG_ANGULAR = DIAG_MOMENTUM + 3, DIAG_KINETIC = DIAG_ANGULAR + 3,
+       DIAG_POTENTIAL, DIAG_TERMS };
+
+typedef struct {
+	nb_world_t *world;
+	int        *rowStart;  // Rows of the pair sum for each task, chosen so that each has about the same number of pairs.
+	kahan_t    *sums;      // DIAG_TERMS per task.
+	const float *potential;  // From the last force pass, if it can be used.
+} diagTask_t;
+
+static void diagnosticsTask(void *ctx, int task, int nTasks) {
+	diagTask_t *dt = (diagTask_t *)ctx;
+	nb_world_t *world = dt->world;
+	nb_pva_t   *pva   = world->pva[world->current()];
+	kahan_t    *sums  = &dt->sums[task * DIAG_TERMS];
+	memset(sums, 0, DIAG_TERMS * sizeof(kahan_t));
+
+	int begin, end;
+	nb_taskRange(world->nBodies, task, nTasks, begin, end);
+	for (int i = begin; i < end; i++) {
+		double m = world->bodies[i].mass;
+		float *p = pva[i].position;
+		float *v = pva[i].velocity;
+		kahanAdd(&sums[DIAG_MASS], m);
+		for (int k = 0; k < 3; k++) {
+			kahanAdd(&sums[DIAG_COM + k],      m * p[k]);
+			kahanAdd(&sums[DIAG_MOMENTUM + k], m * v[k]);
+		}
+		kahanAdd(&sums[DIAG_ANGULAR + 0], m * ((double)p[1] * v[2] - (double)p[2] * v[1]));
+		kahanAdd(&sums[DIAG_ANGULAR + 1], m * ((double)p[2] * v[0] - (double)p[0] * v[2]));
+		kahanAdd(&sums[DIAG_ANGULAR + 2], m * ((double)p[0] * v[1] - (double)p[1] * v[0]));
+		kahanAdd(&sums[DIAG_KINETIC], 0.5 * m * ((double)v[0] * v[0] + (double)v[1] * v[1] + (double)v[2] * v[2]));
+
+		// Each pair's potential is counted at both bodies, so halve it.
+		if (dt->potential != NULL)
+			kahanAdd(&sums[DIAG_POTENTIAL], 0.5 * m * dt->potential[i]);
+		else if (world->treePotential)
+			kahanAdd(&sums[DIAG_POTENTIAL], 0.5 * m * nb_treePotentialAt(p, world, i));
+	}
+	if (dt->potential != NULL || world->treePotential)
+		return;
 
+	for (int i = dt->rowStart[task]; i < dt->rowStart[task + 1]; i++) {
+		float *pi = pva[i].position;
+		double row = 0.0;
 		for (int j = i + 1; j < world->nBodies; j++) {
-			M3DVector3f dp;
-			m3dSubtractVectors3(dp, world->getCurrentPVA(i)->position, world->getCurrentPVA(j)->position);
-			etot -= BIGG * world->bodies[i].mass * world->bodies[j].mass/m3dGetVectorLength3(dp);
+			double dx = pva[j].position[0] - pi[0];
+			double dy = pva[j].position[1] - pi[1];
+			double dz = pva[j].position[2] - pi[2];
+			row += world->bodies[j].mass / sqrt(dx*dx + dy*dy + dz*dz);
 		}
+		kahanAdd(&sums[DIAG_POTENTIAL], -BIGG * world->bodies[i].mass * row);
 	}
+}
+
+// Mass, momentum, angular momentum and energy of the current slot, summed in double precision with compensation.
+// Work is split over the world's threads.  With treePotential set, the potential comes from the Barnes-Hut tree, which
+// takes O(N log N) rather than O(N^2), to about the accuracy of the tree's forces.
+// With potentialFromForces set, and the current accelerations still valid, it is added up from the potentials the last
+// force pass found, in O(N).  That is every step of NB_INTEGRATOR_LEAPFROG and NB_INTEGRATOR_DOPRI, and of
+// NB_INTEGRATOR_HERMITE, whose potentials are those of the predicted state, like its accelerations.  The corrector then
+// moves the bodies by O(dt^4), so Hermite's potential energy is approximate, and potentialPredicted says so.  The
+// trapezoid corrector moves the bodies further after its last pass, and block steps evaluate bodies at different times,
+// so they don't.
+void nb_getDiagnostics(nb_diagnostics_t *d, nb_world_t *world) {
+	int n = world->nBodies;
+	int nTasks = taskCount(world);
+	diagTask_t dt;
+	dt.world     = world;
+	dt.rowStart  = (int *)malloc((nTasks + 1) * sizeof(int));
+	dt.sums      = (kahan_t *)malloc(nTasks * DIAG_TERMS * sizeof(kahan_t));
+	dt.potential = NULL;
+	if (world->potentialFromForces && world->accelerationsValid && world->potentialSlot == world->current())
+		dt.potential = world->potential;
+
+	// Row i has n - 1 - i pairs.
+	double pairs = 0.5 * n * (n - 1.0);
+	double done = 0.0;
+	int row = 0;
+	dt.rowStart[0] = 0;
+	for (int task = 1; task < nTasks; task++) {
+		while (row < n && done + (n - 1 - row) <= pairs * task / nTasks)
+			done += n - 1 - row++;
+		dt.rowStart[task] = row;
+	}
+	dt.rowStart[nTasks] = n;
+
+	if (world->treePotential && dt.potential == NULL && n > 0) {
+		nb_tree_t *tree = world->tree;
+		if (tree == NULL || !tree->valid || tree->slot != world->current() || tree->t != world->t)
+			nb_buildTree(world, world->current());
+	}
+	runTasks(world, diagnosticsTask, &dt);
+
+	// Add up the tasks in order, so the result doesn't depend on which finished first.
+	kahan_t total[DIAG_TERMS];
+	memset(total, 0, sizeof(total));
+	for (int task = 0; task < nTasks; task++) {
+		for (int k = 0; k < DIAG_TERMS; k++)
+			kahanAdd(&total[k], dt.sums[task * DIAG_TERMS + k].sum);
+	}
+	free(dt.rowStart);
+	free(dt.sums);
+
+	d->totalMass = total[DIAG_MASS].sum;
+	for (int k = 0; k < 3; k++) {
+		d->centerOfMass[k]    = (d->totalMass > 0.0) ? total[DIAG_COM + k].sum / d->totalMass : 0.0;
+		d->momentum[k]        = total[DIAG_MOMENTUM + k].sum;
+		d->angularMomentum[k] = total[DIAG_ANGULAR + k].sum;
+	}
+	d->kineticEnergy   = total[DIAG_KINETIC].sum;
+	d->potentialEnergy = total[DIAG_POTENTIAL].sum;
+	d->totalEnergy     = d->kineticEnergy + d->potentialEnergy;
+	d->potentialFromForces = (dt.potential != NULL);
+	d->potentialPredicted  = (dt.potential != NULL) && world->potentialPredicted;
+}
+
+void nb_getSummaryValues(float &mtot, M3DVector3f com, M3DVector3f vtot, float &etot, nb_world_t* world) {
+	nb_diagnostics_t d;
+	nb_getDiagnostics(&d, world);
 
-	m3dScaleVector3(com, 1.0f/mtot);
-	m3dScaleVector3(vtot, 1.0f/mtot);
+	mtot = (float)d.totalMass;
+	for (int k = 0; k < 3; k++) {
+		com[k]  = (float)d.centerOfMass[k];
+		vtot[k] = (d.totalMass > 0.0) ? (float)(d.momentum[k] / d.totalMass) : 0.0f;
+	}
+	etot = (float)d.totalEnergy;
+}
+
+static void *alignedCalloc(size_t n, size_t size) {
+	void *p;
+	if (posix_memalign(&p, NB_ALIGN, n * size) != 0) {
+		printf("Couldn't allocate %lu bytes\n", (unsigned long)(n * size));
+		exit(-1);
+	}
+	memset(p, 0, n * size);
+	return p;
 }
 
 nb_world_t * nb_createWorld(int nBodies) {
@@ -169,39 +1642,274 @@ nb_world_t * nb_createWorld(int nBodies) {
 	world->t       = 0.0f;
 	world->slot    = 0;
 	world->slotMax = NSLOTS - 1;
+	world->mapping     = NULL;
+	world->mappingSize = 0;
+	world->trajectory  = NULL;
+
+	world->forceMode = NB_FORCE_DIRECT;
+	world->theta     = DEFAULT_THETA;
+	world->treePotential = false;
+	world->potentialFromForces = false;
+	world->potential     = NULL;
+	world->potentialSlot = -1;
+	world->potentialPredicted = false;
+	world->tree      = NULL;
+	world->layout    = NB_LAYOUT_AOS;
+	world->simd      = NB_SIMD_NONE;
+	world->pairwise  = false;
+	world->nThreads  = 1;
+	world->pairAcc   = NULL;
+	world->pairPhi   = NULL;
+	world->pairAccThreads = 0;
+	world->pairAccBodies  = 0;
+	world->pool       = NULL;
+	world->pairLists  = NULL;
+	world->nPairLists = 0;
+	world->broadPhase = NB_BROADPHASE_GRID;
+	world->grid       = NULL;
+	world->sweep      = NULL;
+	world->continuousImpacts = false;
+	world->tidalMode         = NB_TIDAL_EXACT;
+	world->tidalMaxRatio     = DEFAULT_TIDAL_MAX_RATIO;
+
+	world->autoDetail    = false;
+	world->minDetail     = 1;
+	world->maxDetail     = DEFAULT_DETAIL + 1;
+	world->pixelsPerUnit = 0.0f;
+	world->detailPixels  = DEFAULT_DETAIL_PIXELS;
+	world->detailStress  = DEFAULT_DETAIL_STRESS;
+	world->heatScale     = DEFAULT_HEAT_SCALE;
+	world->sweptCenters      = NULL;
+	world->sweptRadii        = NULL;
+
+	world->nSteps        = DEFAULT_STEPS;
+	world->stepDt        = 0.0f;
+	world->adaptiveSteps = false;
+	world->stepAccuracy  = DEFAULT_STEP_ACCURACY;
+	world->minSteps      = 1;
+	world->maxSteps      = 10 * DEFAULT_STEPS;
+	world->stepsTaken    = 0;
 
-	world->bodies = (nb_body_t *)malloc(nBodies * sizeof(nb_body_t));
+	world->integrator         = NB_INTEGRATOR_TRAPEZOID;
+	world->accelerationsValid = false;
+	world->jerksValid         = false;
+	world->nForceEvaluations  = 0;
+
+	world->blockAccuracy = DEFAULT_BLOCK_ACCURACY;
+	world->activeBodies  = NULL;
+	world->nActive       = 0;
+
+	world->rkTolerance = DEFAULT_RK_TOLERANCE;
+	world->rkDt        = 0.0f;
+	world->rkRejected  = 0;
+	world->rkK         = NULL;
+
+	int nPadded = (nBodies + NB_PAD - 1) / NB_PAD * NB_PAD;
+	for (int s = 0; s < NSLOTS; s++) {
+		world->pva[s] = (nb_pva_t *)alignedCalloc(nBodies, sizeof(nb_pva_t));
+		world->soa[s].t       = 0.0f;
+		world->soa[s].valid   = false;
+		world->soa[s].nPadded = nPadded;
+		world->soa[s].x    = (float *)alignedCalloc(nPadded, sizeof(float));
+		world->soa[s].y    = (float *)alignedCalloc(nPadded, sizeof(float));
+		world->soa[s].z    = (float *)alignedCalloc(nPadded, sizeof(float));
+		world->soa[s].mass = (float *)alignedCalloc(nPadded, sizeof(float));
+	}
+
+	world->bodies = (nb_body_t *)calloc(nBodies, sizeof(nb_body_t));
 	for (int i = 0; i < world->nBodies; i++) {
-		world->bodies[i].pva = (nb_pva_t *)calloc(NSLOTS, sizeof(nb_pva_t));
-		// Initially we use the same unit sphere for all bodies.  Later we may use more accurate unit spheres for larger bodies.
-		sm_model_t *s = world->bodies[i].unitSphere = sm_getUnitSphere(3);
-		world->bodies[i].sampleVertices = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
-		world->bodies[i].perceivedForceAtSample = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
-		world->bodies[i].pfNormalComponent = (float *)calloc(s->nVertices, sizeof(float));
-		world->bodies[i].displayVertices = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
-		world->bodies[i].displayNormals = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+		world->bodies[i].stepLevel = -1;
+		world->bodies[i].blockTime = 0;
+		world->bodies[i].stretch   = 0.0f;
+		world->bodies[i].stressed  = false;
+		// Initially we use the same unit sphere for all bodies.  With autoDetail, nb_calculatePercievedForces changes it later.
+		// Each body's arrays at DEFAULT_DETAIL take about 50 kB, which adds up in large worlds, so they wait until needed.
+		world->bodies[i].unitSphere = NULL;
+		if (nBodies <= LARGE_WORLD_BODIES)
+			nb_setDetail(world, i, DEFAULT_DETAIL);
 	}
 
 	return world;
 }
 
+// Switch a body to the shared unit sphere of the given precision, reallocating its per-vertex arrays.
+void nb_setDetail(nb_world_t *world, int body, int precision) {
+	nb_body_t *b = &world->bodies[body];
+	if (b->unitSphere != NULL) {
+		if (b->unitSphere->precision == precision)
+			return;
+		sm_releaseModel(b->unitSphere);
+		free(b->sampleVertices);
+		free(b->perceivedForceAtSample);
+		free(b->pfNormalComponent);
+		free(b->displayVertices);
+		free(b->displayNormals);
+		free(b->triNormals);
+		free(b->displayColors);
+	}
+
+	sm_model_t *s = b->unitSphere = sm_acquireUnitSphere(precision);
+	b->sampleVertices = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+	b->perceivedForceAtSample = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+	b->pfNormalComponent = (float *)calloc(s->nVertices, sizeof(float));
+	b->displayVertices = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+	b->displayNormals = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+	b->triNormals = (float *)calloc(3 * s->nTris, sizeof(float));
+	b->displayColors = (M3DVector3f *)calloc(s->nVertices, sizeof(M3DVector3f));
+}
+
+// Precision for a body.  Each level of subdivision halves the triangles' edges, which start at about 1.05 radii on the
+// icosahedron.  If the screen scale is known the edges are kept near detailPixels long on screen, otherwise the largest body
+// gets maxDetail and smaller ones a level less for each halving of the radius.  Bodies stretched by more than
+// detailStress of their radius get one more level, until their stretch falls below half that.
+static float largestRadius(nb_world_t *world) {
+	float maxRadius = 0.0f;
+	for (int i = 0; i < world->nBodies; i++) {
+		if (world->bodies[i].radius > maxRadius)
+			maxRadius = world->bodies[i].radius;
+	}
+	return maxRadius;
+}
+
+// maxRadius is largestRadius(world), found once by the caller rather than once per body.
+static int chooseDetail(nb_world_t *world, int body, float maxRadius) {
+	nb_body_t *b = &world->bodies[body];
+	int precision;
+	if (world->pixelsPerUnit > 0.0f) {
+		float edge = 1.05f * b->radius * world->pixelsPerUnit;
+		precision = 0;
+		while (precision < world->maxDetail && edge > world->detailPixels) {
+			edge /= 2.0f;
+			precision++;
+		}
+	}
+	else {
+		precision = world->maxDetail;
+		for (float r = b->radius * 2.0f; r <= maxRadius && precision > world->minDetail; r *= 2.0f)
+			precision--;
+	}
+
+	if (b->stretch > world->detailStress)
+		b->stressed = true;
+	else if (b->stretch < world->detailStress / 2.0f)
+		b->stressed = false;
+	if (b->stressed)
+		precision++;
+
+	if (precision < world->minDetail) precision = world->minDetail;
+	if (precision > world->maxDetail) precision = world->maxDetail;
+	return precision;
+}
+
+static bool isMapped(nb_world_t *world, void *p) {
+	char *base = (char *)world->mapping;
+	return (base != NULL && (char *)p >= base && (char *)p < base + world->mappingSize);
+}
+
 void nb_freeWorld(nb_world_t *world) {
+	nb_closeTrajectory(world);
 	for (int i = 0; i < world->nBodies; i++) {
-		sm_freeModel(world->bodies[i].unitSphere);
-		free(world->bodies[i].pva);
+		if (world->bodies[i].unitSphere != NULL)
+			sm_releaseModel(world->bodies[i].unitSphere);
 		free(world->bodies[i].sampleVertices);
 		free(world->bodies[i].perceivedForceAtSample);
 		free(world->bodies[i].pfNormalComponent);
 		free(world->bodies[i].displayVertices);
 		free(world->bodies[i].displayNormals);
+		free(world->bodies[i].triNormals);
+		free(world->bodies[i].displayColors);
 	}
+	for (int s = 0; s < NSLOTS; s++) {
+		if (!isMapped(world, world->pva[s]))
+			free(world->pva[s]);
+		free(world->soa[s].x);
+		free(world->soa[s].y);
+		free(world->soa[s].z);
+		free(world->soa[s].mass);
+	}
+	free(world->pairAcc);
+	free(world->pairPhi);
+	free(world->potential);
+	free(world->activeBodies);
+	free(world->rkK);
+	for (int i = 0; i < world->nPairLists; i++)
+		free(world->pairLists[i].pairs);
+	free(world->pairLists);
+	nb_freePool(world->pool);
+	nb_freeTree(world->tree);
+	nb_freeGrid(world->grid);
+	nb_freeSweep(world->sweep);
+	free(world->sweptCenters);
+	free(world->sweptRadii);
 	free(world->bodies);
+	if (world->mapping != NULL)
+		munmap(world->mapping, world->mappingSize);
 	free(world);
 }
 
-void nb_calculatePercievedForces(nb_world_t *world, int body) {
+// Field at a body's center from every other body, its gradient, the tidal tensor: tensor[a, b] = d ff[a] / d x[b],
+// and the tensor's gradient: grad[(3a + b)3 + c] = d2 ff[a] / d x[b] d x[c].
+// Returns the largest ratio of the body's radius to its distance from another body.
+static float calculateTidalTensor(M3DVector3f ff, M3DMatrix33f tensor, float grad[27], nb_world_t *world, int body) {
+	float *pos = world->getCurrentPVA(body)->position;
+	float ratio = 0.0f;
+	m3dLoadVector3(ff, 0.0f, 0.0f, 0.0f);
+	for (int k = 0; k < 9; k++)
+		tensor[k] = 0.0f;
+	for (int k = 0; k < 27; k++)
+		grad[k] = 0.0f;
+
+	for (int j = 0; j < world->nBodies; j++) {
+		if (j == body)
+			continue;
+
+		M3DVector3f d;
+		m3dSubtractVectors3(d, world->getCurrentPVA(j)->position, pos);
+		float r2 = m3dGetVectorLengthSquared3(d);
+		float r = sqrtf(r2);
+		float inv3 = BIGG*world->bodies[j].mass/(r2*r);
+		float inv5 = 3.0f * inv3 / r2;
+		float inv7 = 5.0f * inv5 / r2;
+
+		weightedAccumulate(ff, d, inv3);
+		for (int a = 0; a < 3; a++) {
+			for (int b = 0; b < 3; b++) {
+				tensor[3*b + a] += d[a] * d[b] * inv5;
+				for (int c = 0; c < 3; c++) {
+					float g = d[a] * d[b] * d[c] * inv7;
+					if (a == b) g -= d[c] * inv5;
+					if (a == c) g -= d[b] * inv5;
+					if (b == c) g -= d[a] * inv5;
+					grad[(3*a + b)*3 + c] += g;
+				}
+			}
+			tensor[4*a] -= inv3;
+		}
+
+		if (world->bodies[body].radius > ratio * r)
+			ratio = world->bodies[body].radius / r;
+	}
+	return ratio;
+}
+
+// The tree or packed arrays for the current slot, if used, must already have been built.
+static void calculatePercievedForces(nb_world_t *world, int body, float maxRadius) {
+	if (world->autoDetail)
+		nb_setDetail(world, body, chooseDetail(world, body, maxRadius));
+	else if (world->bodies[body].unitSphere == NULL)
+		nb_setDetail(world, body, 0);
+
 	nb_body_t  *b = &world->bodies[body];
 	sm_model_t *s = b->unitSphere;
+	float maxNormal = 0.0f;
+
+	// Bodies close enough to another that the field varies a lot across them use the exact field at each vertex.
+	M3DVector3f centerForce;
+	M3DMatrix33f tensor;
+	float grad[27];
+	bool useTensor = (world->tidalMode == NB_TIDAL_TENSOR &&
+	                  calculateTidalTensor(centerForce, tensor, grad, world, body) <= world->tidalMaxRatio);
+
 	for (int i = 0; i < s->nVertices; i++) {
 		nb_pva_t *pva = world->getCurrentPVA(body);
 		M3DVector3f n;  // Normal.
@@ -212,39 +1920,117 @@ void nb_calculatePercievedForces(nb_world_t *world, int body) {
 		m3dScaleVector3(d, b->radius);
 	
 		m3dAddVectors3(b->sampleVertices[i], pva->position, d); // Percieved force sample position
-		nb_calculateForceFieldAt(b->perceivedForceAtSample[i], b->sampleVertices[i], world, body);  // Force Field at that position
-		m3dSubtractVectors3(b->perceivedForceAtSample[i], b->perceivedForceAtSample[i], pva->acceleration); // Percieved force at that position.  I.e., -(f - a)
+		if (useTensor) {
+			// Force field at that position, to second order in d.
+			M3DVector3f f;
+			m3dRotateVector(f, d, tensor);
+			for (int a = 0; a < 3; a++) {
+				for (int c = 0; c < 3; c++)
+					f[a] += 0.5f * d[c] * (grad[(3*a + 0)*3 + c]*d[0] + grad[(3*a + 1)*3 + c]*d[1] + grad[(3*a + 2)*3 + c]*d[2]);
+			}
+			// That is the field minus centerForce, so the uniform part taken away comes from the same direct sum as the rest,
+			// not from whatever approximation the solver used for the body's acceleration.
+			m3dCopyVector3(b->perceivedForceAtSample[i], f);
+		}
+		else {
+			calculateForceFieldAt(b->perceivedForceAtSample[i], NULL, b->sampleVertices[i], world, world->current(), body);  // Force Field at that position
+			m3dSubtractVectors3(b->perceivedForceAtSample[i], b->perceivedForceAtSample[i], pva->acceleration); // Percieved force at that position.  I.e., -(f - a)
+		}
 		b->pfNormalComponent[i] = m3dDotProduct3(n, b->perceivedForceAtSample[i]); // Normal component of percieved force.
+		if (fabsf(b->pfNormalComponent[i]) > maxNormal)
+			maxNormal = fabsf(b->pfNormalComponent[i]);
 		
 		m3dScaleVector3(d, 1.0 + b->pfNormalComponent[i]/world->stiffness);
 		m3dAddVectors3(b->displayVertices[i], pva->position, d); // Vertex position after tidal stretching
 	}
+	b->stretch = maxNormal / world->stiffness;
 }
 
+void nb_calculatePercievedForces(nb_world_t *world, int body) {
+	prepareCurrentForceField(world);
+	calculatePercievedForces(world, body, largestRadius(world));
+}
+
+// Normal of every triangle, into triNormals as separate x, y and z arrays, then the average of the normals around every vertex.
+// The vector kernel gives the same results as these loops.
 void nb_calculateNormals(nb_world_t *world, int body) {
 	nb_body_t  *b = &world->bodies[body];
 	sm_model_t *s = b->unitSphere;
-	
-	// Calculate normal for every tri.
-	M3DVector3f triNormals[s->nTris];
+	if (world->simd != NB_SIMD_NONE && nb_simdCalculateNormals(b->displayNormals, b->triNormals, s, b->displayVertices, world->simd))
+		return;
+
+	float *nx = b->triNormals;
+	float *ny = nx + s->nTris;
+	float *nz = ny + s->nTris;
 	for (int i = 0; i < s->nTris; i++) {
 		int v0i = s->indices[3*i]; // Index of first tri vertex.
 		int v1i = s->indices[3*i + 1];
 		int v2i = s->indices[3*i + 2];
-		M3DVector3f dv1, dv2;
+		M3DVector3f dv1, dv2, n;
 		m3dSubtractVectors3(dv1, b->displayVertices[v1i], b->displayVertices[v0i]);
 		m3dSubtractVectors3(dv2, b->displayVertices[v2i], b->displayVertices[v0i]);
-		m3dCrossProduct3(triNormals[i], dv1, dv2);
-		m3dNormalizeVector3(triNormals[i]);
+		m3dCrossProduct3(n, dv1, dv2);
+		m3dNormalizeVector3(n);
+		nx[i] = n[0];
+		ny[i] = n[1];
+		nz[i] = n[2];
 	}
 	
 	// use average of tri normals to calculate normal of vertex.
 	for (int i = 0; i < s->nVertices; i++) {
-		m3dLoadVector3(b->displayNormals[i], 0.0f, 0.0f, 0.0f);
-		sm_vertexInfo_t *vi = &s->vInfo[i];
-		for (int j = 0; j < vi->nTris; j++) {
-			m3dAddVectors3(b->displayNormals[i], b->displayNormals[i], triNormals[vi->tris[j]]);
+		M3DVector3f n;
+		m3dLoadVector3(n, 0.0f, 0.0f, 0.0f);
+		for (int k = s->adjStart[i]; k < s->adjStart[i + 1]; k++) {
+			int t = s->adjTris[k];
+			n[0] += nx[t];
+			n[1] += ny[t];
+			n[2] += nz[t];
 		}
-		m3dNormalizeVector3(b->displayNormals[i]);
+		m3dNormalizeVector3(n);
+		m3dCopyVector3(b->displayNormals[i], n);
 	}
 }
+
+// Heat map color for a normal component of perceived force: blue for compression, red for tension.
+static inline void colorForHeat(M3DVector3f color, float heat) {
+	if (heat < -1.0f) heat = -1.0f;
+	if (heat > 1.0f)  heat = 1.0f;
+	color[0] = (heat + 1.0f) / 2.0f;
+	color[1] = 0.5f - fabsf(heat)/2;
+	color[2] = 1.0f - color[0];
+}
+
+typedef struct {
+	nb_world_t *world;
+	int         nextBody;  // Taken atomically, as bodies can differ a lot in cost.
+	float       maxRadius;
+} deformTask_t;
+
+static void deformTask(void *ctx, int task, int nTasks) {
+	deformTask_t *dt = (deformTask_t *)ctx;
+	nb_world_t *world = dt->world;
+	for (;;) {
+		int i = __atomic_fetch_add(&dt->nextBody, 1, __ATOMIC_RELAXED);
+		if (i >= world->nBodies)
+			break;
+
+		calculatePercievedForces(world, i, dt->maxRadius);
+		nb_calculateNormals(world, i);
+
+		nb_body_t *b = &world->bodies[i];
+		for (int v = 0; v < b->unitSphere->nVertices; v++)
+			colorForHeat(b->displayColors[v], b->pfNormalComponent[v] * world->heatScale);
+	}
+}
+
+// Perceived forces, tidally deformed vertices, normals and colors of every body, in parallel.  Afterwards each body's
+// displayVertices, displayNormals and displayColors are ready to draw with its unit sphere's indices.
+void nb_deformWorld(nb_world_t *world) {
+	prepareCurrentForceField(world);
+
+	deformTask_t dt = { world, 0, largestRadius(world) };
+	if (poolTasks(world, world->nBodies > 1) > 1)
+		nb_poolRun(world->pool, deformTask, &dt);
+	else
+		deformTask(&dt, 0, 1);
+}
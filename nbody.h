@@ -8,17 +8,47 @@
 
 #define BIGG 1
 
+#define DEFAULT_THETA 0.5f
+
+#define NSLOTS 2
+
+#define DEFAULT_STEPS 100
+#define DEFAULT_STEP_ACCURACY 0.02f
+#define DEFAULT_BLOCK_ACCURACY 0.02f
+#define DEFAULT_RK_TOLERANCE 1e-6f
+#define DEFAULT_TIDAL_MAX_RATIO 0.2f
+
+#define DEFAULT_DETAIL 3
+#define LARGE_WORLD_BODIES 1000  // Bodies in bigger worlds get a sphere, at detail 0, only when first deformed.
+#define DEFAULT_DETAIL_PIXELS 8.0f
+#define DEFAULT_DETAIL_STRESS 0.05f
+#define DEFAULT_HEAT_SCALE 30.0f
+
+#define DEFAULT_TRAJECTORY_CHUNK 256  // Frames per buffer, and so per chunk of the file.
+
+// Alignment, in bytes, of the per-slot arrays, and the number of floats their length is padded to a multiple of.
+#define NB_ALIGN 64
+#define NB_MAX_THREADS 64  // Pools never have more threads than this, so per task results fit in fixed arrays.
+#define NB_PAD   16
+
 typedef struct nb_pva {
 	M3DVector3f  position;
 	M3DVector3f  velocity;
 	M3DVector3f  acceleration;
+	M3DVector3f  jerk;          // Time derivative of acceleration.  Only kept up to date by the Hermite integrator.
 } nb_pva_t;
 
 typedef struct nb_body {
 	float mass;
 	float radius;
 
-	nb_pva_t *pva;
+	// Block time-steps.  The body steps by the sub-step length / 2^stepLevel.
+	// blockTime is the time its nb_pva_t refers to, in ticks since the start of the sub-step.
+	int stepLevel;
+	int blockTime;
+
+	float stretch;    // Largest tidal stretch at any vertex, as a fraction of the radius, when last calculated.
+	bool  stressed;   // Given an extra level of detail for its stretch.
 
 	sm_model_t   *unitSphere;
 	M3DVector3f  *sampleVertices;
@@ -26,16 +56,187 @@ typedef struct nb_body {
 	float        *pfNormalComponent;
 	M3DVector3f  *displayVertices;
 	M3DVector3f  *displayNormals;
+	M3DVector3f  *displayColors;  // Filled in by nb_deformWorld.
+	float        *triNormals;   // Scratch for nb_calculateNormals: x, y and z of every triangle's normal, as three arrays.
 } nb_body_t;
 
+// How the gravitational field is evaluated.
+typedef enum {
+	NB_FORCE_DIRECT,  // Sum over every other body.  Exact, O(N^2).  The reference.
+	NB_FORCE_TREE     // Barnes-Hut octree.  Approximate, O(N log N).  Accuracy set by the world's theta.
+} nb_forceMode_t;
+
+// Barnes-Hut octree.  Children of a node are allocated as 8 consecutive nodes.
+typedef struct nb_treeNode {
+	M3DVector3f center;     // Geometric center of the cell.
+	float       halfSize;   // Half the length of a side of the cell.
+	M3DVector3f com;        // Center of mass of the bodies in the cell.
+	float       mass;
+	int         firstChild; // -1 for a leaf.
+	int         firstBody;  // Leaves only: first of the cell's bodies in packed.  While building, the head of a list chained through nextBody.
+	int         nBodies;
+} nb_treeNode_t;
+
+// A body as the tree walk sees it, stored leaf by leaf.
+typedef struct nb_treeBody {
+	M3DVector3f position;
+	float       mass;
+	int         body;
+} nb_treeBody_t;
+
+typedef struct nb_tree {
+	int   slot;   // Slot and time the tree was built for.
+	float t;
+	bool  valid;
+
+	int nNodes;
+	int maxNodes;
+	nb_treeNode_t *nodes;
+	int *nextBody;
+	int nBodyLinks;
+	nb_treeBody_t *packed;
+	int nPacked;
+} nb_tree_t;
+
+// How body state is laid out for the force calculation.
+typedef enum {
+	NB_LAYOUT_AOS,  // Read positions straight from the nb_pva_t array of the slot.
+	NB_LAYOUT_SOA   // Gather positions and masses into separate x, y, z and mass arrays first.
+} nb_layout_t;
+
+// Structure-of-arrays copy of the positions and masses of one slot.
+// Arrays are NB_ALIGN aligned and padded to a multiple of NB_PAD with zero mass bodies.
+typedef struct nb_soa {
+	float t;      // Time the arrays were packed at.
+	bool  valid;
+
+	int   nPadded;
+	float *x;
+	float *y;
+	float *z;
+	float *mass;
+} nb_soa_t;
+
+// How handleImpacts finds the pairs of bodies that might be touching.
+typedef enum {
+	NB_BROADPHASE_NONE,  // Test every pair.  O(N^2).
+	NB_BROADPHASE_GRID,  // Only test bodies in neighbouring cells of a uniform grid.  Near O(N) unless the radii vary a lot.
+	NB_BROADPHASE_SWEEP  // Only test bodies whose extents overlap along one axis, kept sorted between sub-steps.
+} nb_broadPhase_t;
+
+// Uniform grid of cubic cells, stored as a hash table.  The bodies in bucket b are bodies[bucketStart[b]] up to
+// bodies[bucketStart[b + 1]], in index order.  Several cells may share a bucket.
+typedef struct nb_grid {
+	float cellSize;
+	int   nBuckets;     // A power of two, at least twice the number of bodies.
+	int  *bucketStart;
+	int  *bodies;
+	int  *bodyCell;     // Cell coordinates of each body, three per body.
+	int   nBodies;      // Bodies the arrays have room for.
+} nb_grid_t;
+
+// Sweep and prune state, kept between calls to handleImpacts.  order lists the bodies by the lower end of their extent
+// along axis, and lo and hi are the extents in that order.
+typedef struct nb_sweep {
+	int    axis;
+	int    nBodies;
+	int   *order;
+	float *lo;
+	float *hi;
+
+	int  nCandidates;   // Pairs whose extents overlap, as consecutive ints.
+	int  maxCandidates;
+	int *candidates;
+} nb_sweep_t;
+
+// How nb_calculatePercievedForces finds the field at a body's sample vertices.
+typedef enum {
+	NB_TIDAL_EXACT,   // Evaluate the field at every vertex.  O(V N) per body.
+	NB_TIDAL_TENSOR   // Extrapolate to second order from the field, tidal tensor and its gradient at the body's center.  O(N + V) per body.
+} nb_tidalMode_t;
+
+// Vector instruction sets for the direct-sum kernel over the SOA layout, in increasing order.
+typedef enum {
+	NB_SIMD_NONE,    // Scalar loop.  Matches NB_LAYOUT_AOS bit for bit.
+	NB_SIMD_AVX2,    // 8 bodies per iteration.
+	NB_SIMD_AVX512,  // 16 bodies per iteration.
+	NB_SIMD_BEST     // Whatever the CPU supports.
+} nb_simd_t;
+
+// How nb_integrate advances each sub-step.
+typedef enum {
+	NB_INTEGRATOR_TRAPEZOID,  // Euler predictor, trapezoid corrector.  Two force evaluations per step.
+	NB_INTEGRATOR_LEAPFROG,   // Kick-drift-kick leapfrog.  Symplectic, one force evaluation per step.
+	NB_INTEGRATOR_HERMITE,    // Fourth order Hermite predictor-corrector.  One direct acceleration and jerk evaluation per step.
+	NB_INTEGRATOR_BLOCK,      // Hermite with per body power of two time-steps.  Only bodies whose step ends are evaluated.
+	NB_INTEGRATOR_DOPRI       // Dormand-Prince 5(4) with error control.  Chooses its own steps to meet rkTolerance.
+} nb_integrator_t;
+
+typedef struct nb_pool nb_pool_t;
+typedef struct nb_trajectory nb_trajectory_t;
+typedef void (*nb_taskFn_t)(void *ctx, int task, int nTasks);
+
+// Pairs of body indices, stored as consecutive ints.
+typedef struct nb_pairList {
+	int nPairs;
+	int maxPairs;
+	int *pairs;
+} nb_pairList_t;
+
 typedef struct nb_world {
 	float radius;
 	float stiffness;
 	float bounceFudgeFactor;
+
+	nb_forceMode_t forceMode;
+	float theta;        // Barnes-Hut opening angle.  Smaller is more accurate and slower.
+	bool  treePotential;  // nb_getDiagnostics sums the potential over the tree, rather than every pair.
+
+	// Force passes also find each body's potential, with the same approximations as its acceleration.  nb_getDiagnostics
+	// then only has to add them up, if the last pass was on the current state.  See nb_getDiagnostics.
+	bool   potentialFromForces;
+	float *potential;      // Per unit mass, for each body, from the last force pass.
+	int    potentialSlot;  // Slot that pass was on, or -1 if it didn't find them.
+	bool   potentialPredicted;  // That pass was on a predicted state, which a corrector has since moved.
+	nb_tree_t *tree;
 	
+	// Sub-steps per call to nb_integrate.  If adaptiveSteps is set, each call picks stepAccuracy times the shortest time
+	// for a body's velocity to change, or for neighbouring bodies to close the gap between them, from the last force pass,
+	// within minSteps and maxSteps.  See chooseSteps.  Otherwise, if stepDt is set, sub-steps are at most stepDt long.
+	// Otherwise there are nSteps of them.
+	int   nSteps;
+	float stepDt;
+	bool  adaptiveSteps;
+	float stepAccuracy;
+	int   minSteps;
+	int   maxSteps;
+	int   stepsTaken;  // By the last call to nb_integrate.
+
+	nb_integrator_t integrator;
+	bool accelerationsValid;  // The current slot's accelerations match its positions.  Clear this after moving bodies by hand.
+	bool jerksValid;          // Likewise for jerks, which also depend on velocities.
+	long long nForceEvaluations;  // Bodies whose field has been evaluated by nb_integrate so far.
+
+	// NB_INTEGRATOR_BLOCK ignores the sub-step settings above.  Sub-steps are as long as the longest step any body wants,
+	// up to the whole call, and no more than maxSteps of them.  See chooseBlockSteps.
+	float blockAccuracy;      // Bodies step by blockAccuracy * |a| / |j|.
+	int  *activeBodies;       // Bodies due at the current block time.
+	int   nActive;
+
+	// NB_INTEGRATOR_DOPRI ignores the sub-step settings above, except that no step is shorter than 1 / maxSteps of the call.
+	float rkTolerance;        // Largest RMS local error per step, relative to 1 + the size of each position and velocity.
+	float rkDt;               // Step length to try next.  Zero to start from 1 / nSteps of the call.
+	int   rkRejected;         // Steps that failed the tolerance so far.
+	M3DVector3f *rkK;         // Derivatives at each stage.
+
 	float t;
 	int slot;
 	int slotMax;
+
+	void  *mapping;       // File that nb_loadWorld mapped the current slot's pva from, if any.
+	size_t mappingSize;
+
+	nb_trajectory_t *trajectory;  // Recording that nb_integrate hands every sub-step to, if any.
 	
 	int current()         { return slot; }
 	int next()            { return (slot != slotMax) ? slot + 1 : 0; }
@@ -44,13 +245,112 @@ typedef struct nb_world {
 
 	int nBodies;
 	nb_body_t *bodies;
+
+	nb_layout_t layout;
+	nb_simd_t   simd;       // Highest instruction set the SOA layout and nb_calculateNormals may use.
+	                        // Capped at runtime to what the CPU has.
+
+	bool pairwise;          // Direct sum visits each pair once and applies equal and opposite accelerations.
+	M3DVector3f *pairAcc;   // Per thread accumulators for pairwise accumulation.
+	float *pairPhi;         // And for potentials, if potentialFromForces is set.
+	int  pairAccThreads;
+	int  pairAccBodies;
+
+	int  nThreads;          // Threads used by nb_integrate, up to NB_MAX_THREADS.  The worker pool is started on first use and restarted if this changes.
+	nb_pool_t *pool;
+	nb_pairList_t *pairLists;  // Per thread lists of overlapping bodies found by handleImpacts.
+	int  nPairLists;
+	nb_broadPhase_t broadPhase;
+	nb_grid_t *grid;
+	nb_sweep_t *sweep;
+
+	// Also bounce pairs that come into contact during a sub-step, at the moment they touch, so fast bodies can't pass
+	// through each other between the checks at the start of each sub-step.  The sub-step is cut short there, and the rest
+	// taken afresh from the bounced state.  Not done by NB_INTEGRATOR_BLOCK.
+	bool continuousImpacts;
+	M3DVector3f *sweptCenters;  // Bounding sphere of each body's path over the last sub-step.
+	float *sweptRadii;
+
+	// With NB_TIDAL_TENSOR, a body uses the exact field anyway if its radius is more than tidalMaxRatio times its distance
+	// from another body.  The tensor's relative error grows as the square of that ratio.
+	nb_tidalMode_t tidalMode;
+	float tidalMaxRatio;
+
+	// Level of detail.  With autoDetail set, nb_calculatePercievedForces picks each body's unit sphere precision,
+	// between minDetail and maxDetail, from its size on screen if pixelsPerUnit is known, or else its radius,
+	// and from how much it is stretched.
+	bool  autoDetail;
+	int   minDetail;
+	int   maxDetail;
+	float pixelsPerUnit;
+	float detailPixels;   // Target triangle edge length on screen.
+	float detailStress;
+
+	float heatScale;      // nb_deformWorld colors vertices by heatScale times the normal component of perceived force.
+	nb_pva_t *pva[NSLOTS];  // State of every body in each slot, contiguous and NB_ALIGN aligned.
+	nb_soa_t  soa[NSLOTS];
 	
-	nb_pva_t *getCurrentPVA(int body) { return &bodies[body].pva[current()]; }
+	nb_pva_t *getPVA(int slot, int body) { return &pva[slot][body]; }
+	nb_pva_t *getCurrentPVA(int body)    { return &pva[current()][body]; }
 } nb_world_t;
 
+// Copy of the world handed from the simulation thread to a reader.  See nb_sim.cpp.
+typedef struct nb_bodySnapshot {
+	M3DVector3f  position;
+	float        radius;
+	sm_model_t  *model;      // Held, so the display buffers' indices stay valid whatever the world does with the body.
+	int          maxVertices;
+	M3DVector3f *vertices;
+	M3DVector3f *normals;
+	M3DVector3f *colors;
+} nb_bodySnapshot_t;
+
+typedef struct nb_snapshot {
+	float t;
+	long  frame;             // Steps taken when the snapshot was made.
+	long  summaryFrame;      // Steps taken when the totals below were found, which is only every so often.
+	float totalMass;
+	M3DVector3f centerOfMass;
+	M3DVector3f totalVelocity;
+	float totalEnergy;
+	int   nBodies;
+	nb_bodySnapshot_t *bodies;
+} nb_snapshot_t;
+
+typedef struct nb_sim nb_sim_t;
+
+// What nb_openTrajectory records, and how.  See nb_trajectory.cpp for the file format.
+#define NB_TRAJECTORY_DELTA 1
+
+typedef struct nb_trajectorySettings {
+	int   decimation;       // Record every decimation'th sub-step.
+	int   nSelected;        // Bodies to record, listed in selected, or 0 for all of them.
+	const int *selected;
+	bool  delta;            // Store the change in each value since the last frame, in as few bytes as it needs.
+	float positionQuantum;  // If positive, positions are rounded to multiples of this, and stored as integers.
+	float velocityQuantum;  // Likewise velocities.
+	int   framesPerChunk;
+} nb_trajectorySettings_t;
+
+// Conserved quantities, and what they are made of, as found by nb_getDiagnostics.
+typedef struct nb_diagnostics {
+	double      totalMass;
+	M3DVector3d centerOfMass;
+	M3DVector3d momentum;
+	M3DVector3d angularMomentum;  // About the origin.
+	double      kineticEnergy;
+	double      potentialEnergy;
+	double      totalEnergy;
+	bool        potentialFromForces;  // The potential energy came from the last force pass.
+	bool        potentialPredicted;   // And that pass was on the predicted state, so the energy is only approximate.
+} nb_diagnostics_t;
+
+// Worlds that can be generated at any size take the number of bodies and a seed, and always give the same world for the same
+// pair.  Hand placed worlds have a defaultBodies of 0, and ignore both.
 typedef struct nb_creator {
 	const char *name;
-	nb_world_t *(*creator)(void);
+	nb_world_t *(*creator)(int nBodies, unsigned seed);
+	int defaultBodies;
 } nb_creator_t;
 
 extern int nCreators;
@@ -59,12 +359,53 @@ extern nb_creator_t creators[];
 nb_world_t * nb_createWorld(int nBodies);
 void nb_freeWorld(nb_world_t *world);
 
-void nb_calculateForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t world, int excludeBody);
+void nb_calculateForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t *world, int excludeBody);
 void nb_integrate(nb_world_t *world, float dt);
 
+float nb_getForceError(nb_world_t *world);
+
+void nb_buildTree(nb_world_t *world, int slot);
+void nb_treeForceFieldAt(M3DVector3f ff, M3DVector3f pos, nb_world_t *world, int excludeBody);
+void nb_treeFieldAndPotentialAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_world_t *world, int excludeBody);
+float nb_treePotentialAt(M3DVector3f pos, nb_world_t *world, int excludeBody);
+void nb_freeTree(nb_tree_t *tree);
+
+void nb_buildGrid(nb_world_t *world, const float *positions, int stride, float cellSize);
+int  nb_gridNeighbours(nb_grid_t *grid, int body, int *buckets);
+void nb_freeGrid(nb_grid_t *grid);
+
+void nb_sweepCandidates(nb_world_t *world, int slot, float scale);
+void nb_freeSweep(nb_sweep_t *sweep);
+
+nb_pool_t *nb_createPool(int nThreads);
+void nb_freePool(nb_pool_t *pool);
+int  nb_poolThreads(nb_pool_t *pool);
+void nb_poolRun(nb_pool_t *pool, nb_taskFn_t fn, void *ctx);
+void nb_taskRange(int n, int task, int nTasks, int &begin, int &end);
+
+nb_simd_t nb_getCpuSimd();
+bool nb_simdForceFieldAt(M3DVector3f ff, float *phi, M3DVector3f pos, nb_soa_t *soa, int nBodies, int excludeBody, nb_simd_t level);
+bool nb_simdCalculateNormals(M3DVector3f *normals, float *triNormals, sm_model_t *s, M3DVector3f *vertices, nb_simd_t level);
+
+void nb_setDetail(nb_world_t *world, int body, int precision);
 void nb_calculatePercievedForces(nb_world_t *world, int body);
 void nb_calculateNormals(nb_world_t *world, int body);
+void nb_deformWorld(nb_world_t *world);
+
+bool nb_saveWorld(nb_world_t *world, const char *path);
+nb_world_t *nb_loadWorld(const char *path);
+
+void nb_defaultTrajectorySettings(nb_trajectorySettings_t *settings);
+nb_trajectory_t *nb_openTrajectory(nb_world_t *world, const char *path, const nb_trajectorySettings_t *settings);
+void nb_recordTrajectory(nb_trajectory_t *traj, nb_world_t *world);
+bool nb_closeTrajectory(nb_world_t *world);
+
+nb_sim_t *nb_startSim(nb_world_t *world, float dt, float timeScale, bool deform);
+void nb_setSimPixelsPerUnit(nb_sim_t *sim, float pixelsPerUnit);
+nb_snapshot_t *nb_latestSnapshot(nb_sim_t *sim);
+void nb_stopSim(nb_sim_t *sim);
 
+void nb_getDiagnostics(nb_diagnostics_t *diagnostics, nb_world_t *world);
 void nb_getSummaryValues(float &totalMass, M3DVector3f centerOfMass, M3DVector3f totalVelocity, float &totalEnergy, nb_world_t* world);
 
 #endif /* _N_BODY_H */
@@ -0,0 +1,208 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nbody.h"
+
+// Runs a world without any display, as fast as it will go.
+
+const float DT = 0.1f;
+
+const char *integratorNames[] = { "trapezoid", "leapfrog", "hermite", "block", "dopri" };
+const int nIntegrators = sizeof(integratorNames) / sizeof(integratorNames[0]);
+
+const char *forceModeNames[] = { "direct", "tree" };
+const int nForceModes = sizeof(forceModeNames) / sizeof(forceModeNames[0]);
+
+double wallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void printTotals(nb_world_t *world, nb_diagnostics_t *initial) {
+  nb_diagnostics_t d;
+  nb_getDiagnostics(&d, world);
+  printf("Totals @ %-10.4g: %10.3g %10.3g %10.3g %10.3g %10.3g\n", world->t, d.totalEnergy, d.totalEnergy - initial->totalEnergy,
+         m3dGetVectorLength3(d.centerOfMass), m3dGetVectorLength3(d.momentum), m3dGetVectorLength3(d.angularMomentum));
+}
+
+void usage(void) {
+  int i;
+  printf("Usage: nbrun [-d <dt>] [-t <threads>] [-n <bodies>] [-s <seed>] [-o <checkpoint>] [-i <integrator>] [-P] [-f]\n");
+  printf("             [-m <forces> [-a <theta>] [-E]]\n");
+  printf("             [-r <trajectory> [-e <every>] [-z] [-q <quantum>]] <world> <steps>\n");
+  printf(" where <world> is a checkpoint written with -o, or one of: ");
+  for (i = 0; i < nCreators - 1; i++) {
+    printf("%s ", creators[i].name);
+  }
+  printf("%s\n", creators[i].name);
+  printf(" <integrator> is one of: ");
+  for (i = 0; i < nIntegrators - 1; i++) {
+    printf("%s ", integratorNames[i]);
+  }
+  printf("%s\n", integratorNames[i]);
+  printf(" <forces> is one of: ");
+  for (i = 0; i < nForceModes - 1; i++) {
+    printf("%s ", forceModeNames[i]);
+  }
+  printf("%s\n", forceModeNames[i]);
+  printf(" -a sets the tree's opening angle, and -E reports the forces' error against direct summation\n");
+  printf(" -P approximates the potential energy with a Barnes-Hut tree\n");
+  printf(" -f takes the potential energy from the last force evaluation, where the integrator allows\n");
+  printf(" -r records every <every>th sub-step, -z stores changes between frames, and -q rounds to multiples of <quantum>\n");
+  printf(" <bodies> and <seed> only apply to: ");
+  for (i = 0; i < nCreators; i++) {
+    if (creators[i].defaultBodies > 0)
+      printf("%s (%d) ", creators[i].name, creators[i].defaultBodies);
+  }
+  printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  float dt = DT;
+  int nThreads = 1;
+  int nBodies  = 0;
+  unsigned seed = 1;
+  const char *checkpoint = NULL;
+  const char *trajectory = NULL;
+  bool treePotential = false;
+  bool potentialFromForces = false;
+  int integrator = NB_INTEGRATOR_TRAPEZOID;
+  int forceMode  = NB_FORCE_DIRECT;
+  float theta    = DEFAULT_THETA;
+  bool forceError = false;
+  nb_trajectorySettings_t settings;
+  nb_defaultTrajectorySettings(&settings);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:t:n:s:o:i:m:a:Er:e:zq:Pf")) != -1) {
+    switch (opt) {
+    case 'd': dt         = (float)atof(optarg);         break;
+    case 't': nThreads   = atoi(optarg);                break;
+    case 'n': nBodies    = atoi(optarg);                break;
+    case 's': seed       = strtoul(optarg, NULL, 0);    break;
+    case 'o': checkpoint = optarg;                      break;
+    case 'r': trajectory = optarg;                      break;
+    case 'e': settings.decimation = atoi(optarg);       break;
+    case 'z': settings.delta = true;                    break;
+    case 'P': treePotential = true;                     break;
+    case 'f': potentialFromForces = true;               break;
+    case 'a': theta = (float)atof(optarg);              break;
+    case 'E': forceError = true;                        break;
+    case 'm':
+      for (forceMode = 0; forceMode < nForceModes; forceMode++) {
+        if (strcmp(optarg, forceModeNames[forceMode]) == 0)
+          break;
+      }
+      break;
+    case 'i':
+      for (integrator = 0; integrator < nIntegrators; integrator++) {
+        if (strcmp(optarg, integratorNames[integrator]) == 0)
+          break;
+      }
+      break;
+    case 'q': settings.positionQuantum = settings.velocityQuantum = (float)atof(optarg); break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+    return -1;
+  }
+  const char *name = argv[optind];
+  long steps = atol(argv[optind + 1]);
+  if (steps <= 0 || dt <= 0.0f || nThreads < 1 || nBodies < 0 || integrator == nIntegrators ||
+      forceMode == nForceModes || theta <= 0.0f) {
+    usage();
+    return -1;
+  }
+
+  nb_world_t *world = NULL;
+  bool created = false;
+  for (int i = 0; i < nCreators; i++) {
+    if (strcmp(name, creators[i].name) == 0) {
+      if (nBodies == 0)
+        nBodies = creators[i].defaultBodies;
+      else if (creators[i].defaultBodies > 0 && nBodies < 2) {
+        usage();
+        return -1;
+      }
+      world = (creators[i].creator)(nBodies, seed);
+      created = true;
+    }
+  }
+
+  // Anything else is taken to be a checkpoint.
+  double loadTime = wallTime();
+  if (!created)
+    world = nb_loadWorld(name);
+  loadTime = wallTime() - loadTime;
+
+  if (world == NULL) {
+    printf("You need to specify a world\n");
+    usage();
+    return -1;
+  }
+  if (!created)
+    printf("Restarted %d bodies at t = %g from %s in %.3f ms\n", world->nBodies, world->t, name, 1000.0 * loadTime);
+  world->nThreads   = nThreads;
+  world->integrator = (nb_integrator_t)integrator;
+  world->forceMode  = (nb_forceMode_t)forceMode;
+  world->theta      = theta;
+
+  if (trajectory != NULL && nb_openTrajectory(world, trajectory, &settings) == NULL)
+    return -1;
+
+  // Tree potentials cost O(N log N), but are only as accurate as the tree's forces.  Potentials from the force pass cost
+  // almost nothing, but only exist after the first step.
+  world->treePotential       = treePotential;
+  world->potentialFromForces = potentialFromForces;
+  nb_diagnostics_t initial;
+  nb_getDiagnostics(&initial, world);
+  printTotals(world, &initial);
+  if (forceError)
+    printf("Force error %.3g\n", nb_getForceError(world));
+
+  // Report ten times over the run.  The totals aren't counted in the timing.
+  double elapsed = 0.0;
+  long   report  = (steps >= 10) ? steps / 10 : 1;
+  for (long s = 1; s <= steps; s++) {
+    double start = wallTime();
+    nb_integrate(world, dt);
+    elapsed += wallTime() - start;
+
+    if (s % report == 0 || s == steps)
+      printTotals(world, &initial);
+  }
+
+  nb_diagnostics_t last;
+  nb_getDiagnostics(&last, world);
+  M3DVector3d dl;
+  m3dSubtractVectors3(dl, last.angularMomentum, initial.angularMomentum);
+  double e0 = fabs(initial.totalEnergy);
+  double l0 = m3dGetVectorLength3(initial.angularMomentum);
+  printf("%ld steps of %g on %d bodies with %d threads in %.3f s\n", steps, dt, world->nBodies, world->nThreads, elapsed);
+  printf("%.1f steps/s, %.3g force evaluations/s\n", steps / elapsed, world->nForceEvaluations / elapsed);
+  printf("Energy drift %.3g (relative %.3g)\n", last.totalEnergy - initial.totalEnergy,
+         (e0 > 0.0) ? (last.totalEnergy - initial.totalEnergy) / e0 : 0.0);
+  printf("Angular momentum drift %.3g (relative %.3g)\n", m3dGetVectorLength3(dl), (l0 > 0.0) ? m3dGetVectorLength3(dl) / l0 : 0.0);
+  if (last.potentialPredicted)
+    printf("Potential energy is from the predicted state, so the energy drift is approximate\n");
+  if (forceError)
+    printf("Force error %.3g\n", nb_getForceError(world));
+
+  if (trajectory != NULL && !nb_closeTrajectory(world))
+    return -1;
+  if (checkpoint != NULL && !nb_saveWorld(world, checkpoint))
+    return -1;
+
+  nb_freeWorld(world);
+  sm_purgeUnitSpheres();
+  return 0;
+}
@@ -11,39 +11,22 @@
 
 const float SCALE = 30.0f;
 const float DT    = 0.1f;
-const float HEAT_SCALE = 30.0f;
 
 M3DVector4f lightPos  = { 100.0f, 100.0f, 50.0f, 1.0f };  // Point source
 
 nb_world_t *world = NULL;
+nb_sim_t   *sim   = NULL;
 float initialEnergy;
-int i = 0;
-
-void setColorForHeat(M3DVector3f color, float heat) {
-  heat *= HEAT_SCALE;
-  if (heat < -1.0f) heat = -1.0f;
-  if (heat > 1.0f)  heat = 1.0f;
-  color[0] = (heat + 1.0f) / 2.0f;
-  color[1] = 0.5f - fabsf(heat)/2;
-  color[2] = 1.0f - color[0];
-}
-
-void renderModel(nb_world_t *world, int body) {
-  nb_body_t  *b = &world->bodies[body];
-  sm_model_t *s = b->unitSphere;
-  M3DVector3f colors[s->nVertices];
-
-  for (int i = 0; i < s->nVertices; i++) {
-    setColorForHeat(colors[i], b->pfNormalComponent[i]);
-  }
+long  lastTotals = -1;
 
+void renderModel(nb_bodySnapshot_t *b) {
   glEnableClientState(GL_VERTEX_ARRAY);
   glEnableClientState(GL_NORMAL_ARRAY);
   glEnableClientState(GL_COLOR_ARRAY);
-  glVertexPointer(3, GL_FLOAT, 0, b->displayVertices);
-  glNormalPointer(GL_FLOAT, 0, b->displayNormals);
-  glColorPointer(3, GL_FLOAT, 0, colors);
-  glDrawElements(GL_TRIANGLES, s->nTris * 3, GL_UNSIGNED_INT, s->indices);
+  glVertexPointer(3, GL_FLOAT, 0, b->vertices);
+  glNormalPointer(GL_FLOAT, 0, b->normals);
+  glColorPointer(3, GL_FLOAT, 0, b->colors);
+  glDrawElements(GL_TRIANGLES, b->model->nTris * 3, GL_UNSIGNED_INT, b->model->indices);
   glDisableClientState(GL_VERTEX_ARRAY);
   glDisableClientState(GL_NORMAL_ARRAY);
   glDisableClientState(GL_COLOR_ARRAY);
@@ -53,20 +36,18 @@ void renderModel(nb_world_t *world, int body) {
 void RenderScene(void) {
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  if (i%1000 == 0) {
-    float mtot, etot;
-    M3DVector3f vtot, com;
-    nb_getSummaryValues(mtot, com, vtot, etot, world);
-    printf("Totals @ %-10.4g: %10.3g %10.3g %10.3g %10.3g\n", world->t, etot, etot - initialEnergy, m3dGetVectorLength3(com), m3dGetVectorLength3(vtot));
-  }
-  i++;
-
-  nb_integrate(world, DT);
-
-  for (int i = 0; i < world->nBodies; i++) {
-    nb_calculatePercievedForces(world, i);
-    nb_calculateNormals(world, i);
-    renderModel(world, i);
+  // The world belongs to the simulation thread, so draw whatever it last finished.
+  nb_snapshot_t *snap = nb_latestSnapshot(sim);
+  if (snap != NULL) {
+    if (snap->summaryFrame != lastTotals) {
+      lastTotals = snap->summaryFrame;
+      printf("Totals @ %-10.4g: %10.3g %10.3g %10.3g %10.3g\n", snap->t, snap->totalEnergy, snap->totalEnergy - initialEnergy,
+             m3dGetVectorLength3(snap->centerOfMass), m3dGetVectorLength3(snap->totalVelocity));
+    }
+
+    for (int i = 0; i < snap->nBodies; i++) {
+      renderModel(&snap->bodies[i]);
+    }
   }
 
   glutSwapBuffers();
@@ -117,6 +98,8 @@ void ChangeSize(int w, int h) {
   }
 
   glViewport(0, 0, w, h);
+  // The world belongs to the simulation thread, which picks up the new scale before its next step.
+  nb_setSimPixelsPerUnit(sim, (GLfloat)h / windowHeight);
 
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
@@ -130,23 +113,36 @@ void ChangeSize(int w, int h) {
 
 void usage(void) {
   int i;
-  printf("Usage: nbtest <world>\n");
+  printf("Usage: nbtest <world> [<bodies> [<seed>]]\n");
   printf(" where <world> is one of: ");
   for (i = 0; i < nCreators - 1; i++) {
     printf("%s ", creators[i].name);
   }
   printf("%s\n", creators[i].name);
+  printf(" <bodies> and <seed> only apply to: ");
+  for (i = 0; i < nCreators; i++) {
+    if (creators[i].defaultBodies > 0)
+      printf("%s (%d) ", creators[i].name, creators[i].defaultBodies);
+  }
+  printf("\n");
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
+  if (argc < 2 || argc > 4) {
     usage();
     return -1;
   }
 
   for (int i = 0; i < nCreators; i++) {
-    if (strcmp(argv[1], creators[i].name) == 0)
-      world = (creators[i].creator)();
+    if (strcmp(argv[1], creators[i].name) == 0) {
+      int nBodies   = (argc > 2) ? atoi(argv[2]) : creators[i].defaultBodies;
+      unsigned seed = (argc > 3) ? strtoul(argv[3], NULL, 0) : 1;
+      if (creators[i].defaultBodies > 0 && nBodies < 2) {
+        usage();
+        return -1;
+      }
+      world = (creators[i].creator)(nBodies, seed);
+    }
   }
 
   if (world == NULL) {
@@ -155,6 +151,8 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+  world->autoDetail = true;
+
   float mtot;
   M3DVector3f vtot, com;
   nb_getSummaryValues(mtot, com, vtot, initialEnergy, world);
@@ -174,6 +172,9 @@ int main(int argc, char* argv[]) {
 
   SetupRC();
 
+  // Aim for the same pace as one step per frame at 60 frames per second.
+  sim = nb_startSim(world, DT, 60.0f * DT, true);
+
   glutMainLoop();
   return 0;
 }
@@ -0,0 +1,65 @@
+#include <glew.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "sphereModels.h"
+
+// Immediate mode drawing of sphere models.  Kept apart from sphereModels.cpp so that programs that only build
+// models don't need to link with GL.
+
+#if SM_TRIANGLE_STRIP != GL_TRIANGLE_STRIP || SM_TRIANGLE_FAN != GL_TRIANGLE_FAN
+#error "Sphere model chunk types must match the GL primitive types"
+#endif
+
+void sm_renderChunk(sm_model_t *m, sm_chunk_t *c) {
+	int start = 0;
+
+    glBegin((GLenum)c->type);
+    if (c->type == SM_TRIANGLE_FAN) {
+		glNormal3fv(m->vertices[c->vertices[0]]);
+		glVertex3fv(m->vertices[c->vertices[0]]);
+		start++;
+	}
+	if (c->backwards) {
+		for (int j = c->nVertices - 1; j >= start; j--) {
+			glNormal3fv(m->vertices[c->vertices[j]]);
+			glVertex3fv(m->vertices[c->vertices[j]]);
+		}
+	}
+	else {
+		for (int j = start; j < c->nVertices; j++) {
+			glNormal3fv(m->vertices[c->vertices[j]]);
+			glVertex3fv(m->vertices[c->vertices[j]]);
+		}
+	}
+    glEnd();
+}
+
+void sm_renderIcosahedronFrame() {
+	sm_model_t *m = sm_getUnitIsocahedron();
+	int j;
+
+    glColor3f(1.0f, 0.0f, 0.0f);
+    int pnl[] = {0, 1, 10, 11};
+    glBegin(GL_TRIANGLE_STRIP);
+    for (j = 0; j < 4; j++)
+        glVertex3fv(m->vertices[pnl[j]]);
+    glEnd();
+
+    glColor3f(0.0f, 1.0f, 0.0f);
+    int pnl2[] = {2, 5, 9, 6};
+    glBegin(GL_TRIANGLE_STRIP);
+    for (j = 0; j < 4; j++)
+        glVertex3fv(m->vertices[pnl2[j]]);
+    glEnd();
+
+    glColor3f(0.0f, 0.0f, 1.0f);
+    int pnl3[] = {3, 4, 8, 7};
+    glBegin(GL_TRIANGLE_STRIP);
+    for (j = 0; j < 4; j++)
+        glVertex3fv(m->vertices[pnl3[j]]);
+    glEnd();
+
+    sm_freeModel(m);
+}
@@ -1,7 +1,6 @@
-#include <glew.h>
-
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "sphereModels.h"
 
@@ -44,34 +43,33 @@ void sm_freeModel(sm_model_t *m) {
     free(m->vInfo);
     free(m->tris);
     free(m->indices);
+    free(m->adjStart);
+    free(m->adjTris);
     free(m);
 }
 
-void sm_renderChunk(sm_model_t *m, sm_chunk_t *c) {
-	int start = 0;
-
-    glBegin(c->type);
-    if (c->type == GL_TRIANGLE_FAN) {
-		glNormal3fv(m->vertices[c->vertices[0]]);
-		glVertex3fv(m->vertices[c->vertices[0]]);
-		start++;
-	}
-	if (c->backwards) {
-		for (int j = c->nVertices - 1; j >= start; j--) {
-			glNormal3fv(m->vertices[c->vertices[j]]);
-			glVertex3fv(m->vertices[c->vertices[j]]);
-		}
-	}
-	else {
-		for (int j = start; j < c->nVertices; j++) {
-			glNormal3fv(m->vertices[c->vertices[j]]);
-			glVertex3fv(m->vertices[c->vertices[j]]);
-		}
+void sm_buildAdjacency(sm_model_t *m) {
+	if (m->adjStart != NULL)
+		return;
+
+	m->adjStart = (int *)calloc(m->nVertices + 1, sizeof(int));
+	m->adjTris  = (int *)malloc(m->nTris * 3 * sizeof(int));
+	for (int i = 0; i < m->nTris * 3; i++)
+		m->adjStart[m->indices[i] + 1]++;
+	for (int v = 0; v < m->nVertices; v++)
+		m->adjStart[v + 1] += m->adjStart[v];
+
+	// Fill each vertex's row from its end, going backwards through the triangles, which leaves adjStart[v + 1]
+	// at the start of vertex v's row.
+	for (int t = m->nTris - 1; t >= 0; t--) {
+		for (int k = 2; k >= 0; k--)
+			m->adjTris[--m->adjStart[m->indices[3*t + k] + 1]] = t;
 	}
-    glEnd();
+	for (int v = 0; v < m->nVertices; v++)
+		m->adjStart[v] = m->adjStart[v + 1];
+	m->adjStart[m->nVertices] = m->nTris * 3;
 }
 
-
 #ifdef DEBUG
 static void printModel(sm_model_t *m) {
 	printf("Vertexes %d, layers %d, chunks %d, tris %d (%d)\n", m->nVertices, m->nLayers, m->nChunks, m->nTris, m->nextTri);
@@ -102,7 +100,7 @@ static void printModel(sm_model_t *m) {
 const int FAN_SIZE = 5;
 
 static void loadFanChunk(sm_model_t *model, sm_chunk_t *chunk, sm_level_t *apexLevel, sm_level_t *nextLevel, bool backwards) {
-    chunk->type         = GL_TRIANGLE_FAN;
+    chunk->type         = SM_TRIANGLE_FAN;
     chunk->nVertices    = FAN_SIZE + 2;
     chunk->vertices     = (int*)calloc(chunk->nVertices, sizeof(int));
     chunk->backwards    = backwards;
@@ -120,7 +118,7 @@ static void loadFanChunk(sm_model_t *model, sm_chunk_t *chunk, sm_level_t *apexL
 }
 
 static void loadStripChunk(sm_model_t *model, sm_chunk_t *chunk, sm_level_t *l0, sm_level_t *l1, int s0, int s1, int nVertices, bool backwards) {
-    chunk->type         = GL_TRIANGLE_STRIP;
+    chunk->type         = SM_TRIANGLE_STRIP;
     chunk->nVertices    = nVertices;
     chunk->vertices     = (int*)calloc(chunk->nVertices, sizeof(int));
     chunk->backwards    = backwards;
@@ -206,34 +204,6 @@ sm_model_t *sm_getUnitIsocahedron() {
     return ret;
 }
 
-void sm_renderIcosahedronFrame() {
-	sm_model_t *m = sm_getUnitIsocahedron();
-	int j;
-
-    glColor3f(1.0f, 0.0f, 0.0f);
-    int pnl[] = {0, 1, 10, 11};
-    glBegin(GL_TRIANGLE_STRIP);
-    for (j = 0; j < 4; j++)
-        glVertex3fv(m->vertices[pnl[j]]);
-    glEnd();
-
-    glColor3f(0.0f, 1.0f, 0.0f);
-    int pnl2[] = {2, 5, 9, 6};
-    glBegin(GL_TRIANGLE_STRIP);
-    for (j = 0; j < 4; j++)
-        glVertex3fv(m->vertices[pnl2[j]]);
-    glEnd();
-
-    glColor3f(0.0f, 0.0f, 1.0f);
-    int pnl3[] = {3, 4, 8, 7};
-    glBegin(GL_TRIANGLE_STRIP);
-    for (j = 0; j < 4; j++)
-        glVertex3fv(m->vertices[pnl3[j]]);
-    glEnd();
-
-    sm_freeModel(m);
-}
-
 static inline void calculateBisector(M3DVector3f mid, M3DVector3f v1, M3DVector3f v2) {
 	mid[0] = v1[0] + v2[0];
 	mid[1] = v1[1] + v2[1];
@@ -263,9 +233,9 @@ static sm_model_t *createNewModelFromOld(sm_model_t *oldModel) {
 	int nChunks = 0;
 
 	for (i = 0; i < oldModel->nChunks; i++) {
-		if (oldModel->chunks[i].type == GL_TRIANGLE_FAN)        // Each fan becomes a fan + n strips where n is the number of tris;
+		if (oldModel->chunks[i].type == SM_TRIANGLE_FAN)        // Each fan becomes a fan + n strips where n is the number of tris;
 			nChunks += 1 + oldModel->chunks[i].nVertices - 2;
-		else if (oldModel->chunks[i].type == GL_TRIANGLE_STRIP)	// Each strip becomes 2 strips.
+		else if (oldModel->chunks[i].type == SM_TRIANGLE_STRIP)	// Each strip becomes 2 strips.
 			nChunks += 2;
 	}
 
@@ -452,3 +422,49 @@ sm_model_t *sm_getUnitSphere(int precision) {
 	sm_freeModel(oldModel);
 	return newModel;
 }
+
+// Shared unit spheres, one per precision.  Models handed out here are shared between their users, so must not be modified.
+#define SM_MAX_CACHED_PRECISION 8
+
+static sm_model_t     *cachedSpheres[SM_MAX_CACHED_PRECISION + 1];
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns a reference to the shared unit sphere of the given precision, building it on first use.
+// Every call must be matched by a call to sm_releaseModel.
+sm_model_t *sm_acquireUnitSphere(int precision) {
+	if (precision < 0 || precision > SM_MAX_CACHED_PRECISION) {
+		printf("No cached sphere of precision %d\n", precision);
+		exit(-1);
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	sm_model_t *m = cachedSpheres[precision];
+	if (m == NULL) {
+		m = cachedSpheres[precision] = sm_getUnitSphere(precision);
+		m->precision = precision;
+		sm_buildAdjacency(m);
+	}
+	m->refCount++;
+	pthread_mutex_unlock(&cacheLock);
+	return m;
+}
+
+// Drops a reference taken by sm_acquireUnitSphere.  Unused spheres stay cached, as level of detail switches bodies
+// back and forth between precisions, until sm_purgeUnitSpheres.
+void sm_releaseModel(sm_model_t *m) {
+	pthread_mutex_lock(&cacheLock);
+	m->refCount--;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+// Frees the cached spheres nobody holds a reference to.
+void sm_purgeUnitSpheres() {
+	pthread_mutex_lock(&cacheLock);
+	for (int p = 0; p <= SM_MAX_CACHED_PRECISION; p++) {
+		if (cachedSpheres[p] != NULL && cachedSpheres[p]->refCount == 0) {
+			sm_freeModel(cachedSpheres[p]);
+			cachedSpheres[p] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
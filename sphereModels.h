@@ -1,13 +1,17 @@
 /* Data structures used to define models. */
 
-#include <gl.h>
 #include "math3d.h"
 
 #ifndef _TIDES_SPHERE_MODELS_H
 #define _TIDES_SPHERE_MODELS_H
 
+// Chunk types.  The same values as GL_TRIANGLE_STRIP and GL_TRIANGLE_FAN, which sm_render.cpp passes to glBegin, but
+// defined here so that building models doesn't need the GL headers.
+#define SM_TRIANGLE_STRIP 0x0005
+#define SM_TRIANGLE_FAN   0x0006
+
 typedef struct {
-  GLenum type;
+  unsigned int type;
   int nVertices;
   int *vertices;
   bool backwards;
@@ -62,6 +66,9 @@ typedef struct {
 } sm_vertexInfo_t;
 
 typedef struct {
+  int refCount;      // References held through sm_acquireUnitSphere.  Zero for models the caller owns outright.
+  int precision;
+
   int nVertices;
   M3DVector3f     *vertices;
   sm_vertexInfo_t *vInfo;
@@ -78,6 +85,11 @@ typedef struct {
   sm_tri_t   *tris;
   unsigned *indices;
 
+  // Triangles around each vertex, in compressed sparse row form: the triangles around vertex v are
+  // adjTris[adjStart[v]] up to adjTris[adjStart[v + 1]], in increasing order.  Built by sm_buildAdjacency.
+  int *adjStart;
+  int *adjTris;
+
   sm_chunk_t *getChunk(int layer, int offset) {
     sm_layer_t *l = &layers[layer];
     return &chunks[l->firstChunk + offset];
@@ -102,8 +114,12 @@ typedef struct {
 } sm_model_t;
 
 void sm_freeModel(sm_model_t*m);
+void sm_buildAdjacency(sm_model_t *m);
 void sm_renderChunk(sm_model_t *m, sm_chunk_t *c);
 sm_model_t *sm_getUnitIsocahedron();
 sm_model_t *sm_getUnitSphere(int precision);
+sm_model_t *sm_acquireUnitSphere(int precision);
+void sm_releaseModel(sm_model_t *m);
+void sm_purgeUnitSpheres();
 
 #endif /* _TIDES_SPHERE_MODELS_H */